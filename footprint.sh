@@ -0,0 +1,25 @@
+#!/bin/sh
+# Report code (.text), initialized data (.data) and zeroed data (.bss) of uP.c for each feature profile (see UP_PROFILE in uP.h,
+# STANDARD by default),
+# against uP.c as it was at a baseline commit (the first commit, unless another is given), so that growth is easy to spot.
+# Figures are for the host compiler, unless another is given, as:
+#   CC=arm-none-eabi-gcc SIZE=arm-none-eabi-size CFLAGS="-mcpu=cortex-m0 -mthumb" ./footprint.sh
+#   BASE=<commit> ./footprint.sh
+CC=${CC:-gcc}
+SIZE=${SIZE:-size}
+BASE=${BASE:-$(git rev-list --max-parents=0 HEAD | tail -n 1)}
+OUT=$(mktemp -d)
+trap 'rm -rf $OUT' EXIT
+
+mkdir $OUT/base
+git show $BASE:uP.c > $OUT/base/uP.c && git show $BASE:uP.h > $OUT/base/uP.h || exit 1
+$CC -Os $CFLAGS -c $OUT/base/uP.c -o $OUT/uP_BASELINE.o || exit 1
+for profile in MINIMAL STANDARD FULL
+do
+  $CC -Os $CFLAGS -DUP_PROFILE=UP_PROFILE_$profile -c uP.c -o $OUT/uP_$profile.o || exit 1
+done
+
+cd $OUT && $SIZE uP_BASELINE.o uP_MINIMAL.o uP_STANDARD.o uP_FULL.o | awk '
+  NR == 1 { print $0 "\t.text vs baseline"; next }
+  NR == 2 { base = $1; print $0 "\t(baseline " BASE ")"; next }
+  { printf "%s\t%+d (%.0f%%)\n", $0, $1 - base, ($1 - base) * 100 / base }' BASE=$(echo $BASE | cut -c1-7)
@@ -37,6 +37,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include "uP.h"
 
 /**
@@ -48,24 +49,210 @@ enum
   ESC_UNHANDLED = -2,   // escape sequence started but no match to handled, so ignore last character 
   ESC_PROCESSING = -1,  // wait for it.. still processing escape sequence, so don't do anything yet
   ESC_NO_ACTION = 0,    // not in an escape sequence, or failed to complete an escape sequence, caller should treat as regular character
-  ESC_UP_ARROW = 1,     // these must follow in order with kEscapes[] list, declared in processEscapes()
-  ESC_DOWN_ARROW,
-  ESC_RIGHT_ARROW,
-  ESC_LEFT_ARROW,
-  ESC_F1,
-  ESC_F2,
-  ESC_F3,
-  ESC_F4,
-  ESC_TAB = 9,  // not actually an escape sequence, but overlaps our enumeration
-  ESC_F5,
-  ESC_F6,
-  ESC_F7,
-  ESC_F8,
-  ESC_F9,
-  ESC_DEL,
-  ESC_HOME,
-  ESC_END,
+  ESC_PASTE_START = 0x1000, // bracketed paste markers, sent by terminal around pasted text once enabled by uP_setBracketedPaste()
+  ESC_PASTE_END,
+  ESC_LONE,             // escape not starting any known sequence - caller should treat as the escape key, then the character as usual
+                        // otherwise, a key recognized, as UP_KEY_ (from 0x100)
 };
+#define NUM_KEYS (UP_KEY_F9 + 1)    // keys that may be bound: any byte, then the UP_KEY_ keys
+
+/**
+ * @brief States for receiving a machine-mode request frame, in order of the fields of the frame.
+ * 
+ */
+enum
+{
+  FRAME_SOF = 0,
+  FRAME_LEN_LO,
+  FRAME_LEN_HI,
+  FRAME_PAYLOAD,
+  FRAME_CRC_LO,
+  FRAME_CRC_HI,
+};
+
+#if UP_COMPILED_SCRIPTS
+/**
+ * @brief Statement types of a compiled script.
+ * 
+ */
+enum
+{
+  PROG_COMMAND = 0,   // call a handler
+  PROG_REPEAT,        // repeat <count> - run block count times
+  PROG_END,           // end of repeat block
+  PROG_IF_OK,         // if ok - run block if previous command succeeded
+  PROG_IF_FAIL,       // if fail - run block if previous command failed
+  PROG_ELSE,          // else - end of if block, start of else block
+  PROG_LET,           // let <var> <value> [+|- <value>]
+};
+#define PARAM_SESSION_VAR -2  // uP_Program.paramVar[] of a parameter given as $name, that names no variable of the script
+#endif
+
+#if UP_PARSE_CACHE
+/**
+ * @brief A command as split and looked up by processLine(), kept for the next time the same command is given.
+ * 
+ */
+typedef struct
+{
+  uint32_t hash;        // hash of command text, for quick rejection
+  unsigned short len;   // length of command text, 0 if entry unused
+  unsigned short used;  // when last used, to replace the least recently used entry
+  short cmdIdx;         // index of command handler, or -1 if unknown
+  unsigned char numTok; // number of tokens, command first
+  uint16_t vars;        // tokens that name variables, as $name, to substitute each time the command is used
+  unsigned short tokStart[MAX_PARAMETERS+1];  // offset of each token in text
+  unsigned short tokEnd[MAX_PARAMETERS+1];    // offset of each token's null-terminator
+  char text[MAX_TOTAL_COMMAND_CHARS+1];     // command text as given, before splitting
+} ParseCacheEntry;
+#endif
+
+#if UP_ALIASES
+/**
+ * @brief An alias, as defined by the built-in "alias" command. Its name and commands are kept in g_aliasText[], the commands
+ * split into tokens when defined, and listed in g_aliasTok[] as offsets, with ALIAS_END after each command.
+ * 
+ */
+typedef struct
+{
+  unsigned short name;      // offset of name in g_aliasText[], followed by the tokens
+  unsigned short firstTok;  // index of first token in g_aliasTok[]
+  unsigned short numTok;    // tokens in g_aliasTok[], including an ALIAS_END for each command
+  bool params;              // commands take parameters given as $1..$9, otherwise they follow the last command
+} Alias;
+#define ALIAS_END 0xFFFF    // in g_aliasTok[], ends a command
+#endif
+
+#if UP_VARIABLES
+/**
+ * @brief A variable, as set by the built-in "set" command. Its name and value are kept in the text of the session's
+ * Variables, and it is found by name through their hash index.
+ * 
+ */
+typedef struct
+{
+  uint32_t hash;          // hash of name
+  unsigned short name;    // offset of name in text[], followed by the value
+  unsigned short value;   // offset of value in text[]
+} Variable;
+#define VAR_INDEX_SIZE (MAX_VARIABLES * 2)  // slots in the hash index, so it is never more than half full
+
+/**
+ * @brief The variables of one session, so that each terminal (or pool client) has its own $names. Static for the default
+ * session, otherwise carved from memory given to uP_Init(), text[] sized as configured.
+ * 
+ */
+typedef struct
+{
+  Variable var[MAX_VARIABLES+1];    // variables, in the order set, with room for one being replaced
+  short index[VAR_INDEX_SIZE];      // hash index of variables, by name: index in var[] plus one, 0 if slot free
+  int numVars;                      // variables in var[]
+  int textLen;                      // characters used in text[]
+  int textSize;                     // size of text[]
+  char * text;                      // variable names and values, null-terminated, in the order set
+} Variables;
+#endif
+
+#if UP_PIPES
+/**
+ * @brief A line of output passed through a pipe, in g_pipeBuf[]. Filters pass lines on by keeping, dropping or reordering
+ * slices, never copying the text.
+ * 
+ */
+typedef struct
+{
+  unsigned short start; // offset of line in g_pipeBuf[]
+  unsigned short len;   // length of line, including its line end
+} Slice;
+#define PIPE_RESERVE 16     // characters of g_pipeBuf[] kept back from commands, for filter output such as a count
+#endif
+
+#define UP_TIMERS (UP_WATCH || UP_IDLE_TIMEOUTS)    // timer wheel needed, for watches or idle timeouts
+#define UP_RESPONSES (UP_FEATURE_MACHINE || UP_FEATURE_JSON)    // capture buffer needed, for machine-mode or JSON responses
+
+#if UP_TIMERS
+/**
+ * @brief A timer, on the timer wheel driven by uP_Poll(). Timers are kept in lists, one per slot of the wheel, each slot
+ * holding those due in one tick (level 0), or in one span of 64 ticks (level 1), 64 * 64 ticks (level 2), and so on. So
+ * starting, stopping or running a timer costs the same however many there are, and the wheel costs next to nothing per tick
+ * but for the timers due. Timers of a higher level move down a level (cascade) as their span comes round.
+ * Timers live in what they time, such as a watch or a session, so there is no limit to how many run. Zeroed, a timer is
+ * stopped.
+ * 
+ */
+typedef struct Timer Timer;
+struct Timer
+{
+  unsigned long expires;    // tick when due
+  Timer * next;             // next timer in wheel slot, NULL if last
+  Timer * prev;             // previous timer in wheel slot, NULL if first
+  short slot;               // wheel slot holding timer plus one (level * WHEEL_SLOTS + index + 1), 0 if not running
+  void (*fire)(void * arg); // called when due
+  void * arg;               // given to fire()
+};
+#define WHEEL_BITS 6                    // bits of tick per level of the wheel
+#define WHEEL_SLOTS (1 << WHEEL_BITS)   // slots per level of the wheel
+#define WHEEL_LEVELS 4                  // levels of the wheel, which reaches WHEEL_SLOTS ^ WHEEL_LEVELS ticks ahead
+#endif
+
+#if UP_WATCH
+/**
+ * @brief A command run periodically, by the built-in "watch" command.
+ * 
+ */
+typedef struct
+{
+  uP_Session * session;     // session the watch runs in, NULL if watch not in use
+  Timer timer;              // due at the next run
+  unsigned long periodMs;   // interval between runs
+  signed char dash;         // dashboard in g_dash[] the output is drawn by, -1 if drawn in full each run
+  char cmd[MAX_TOTAL_COMMAND_CHARS+1];  // command line to run
+} Watch;
+
+/**
+ * @brief The output of a watch as last drawn (watch -d), to compare with the next run, so that only the characters changed
+ * need be sent. The output stays just above the prompt, until the terminal scrolls.
+ * 
+ */
+typedef struct
+{
+  bool inUse;               // dashboard belongs to a watch
+  bool drawn;               // frame[] is on the terminal, in lines just above the prompt
+  int len;                  // characters in frame[]
+  int lines;                // lines in frame[]
+  unsigned long linesOut;   // session's linesOut as of drawing frame[] - if since changed, frame[] has scrolled
+  unsigned long sent;       // characters sent by the latest refresh
+  unsigned long saved;      // characters saved by the latest refresh, against drawing the output in full
+  char frame[MAX_DASHBOARD_CHARS];  // output of the latest run
+} Dashboard;
+#define DASH_GAP 4          // changes with fewer unchanged characters between are sent as one, rather than move the cursor
+#endif
+
+/**
+ * @brief Output captured in place of being sent to the terminal, as for a machine-mode response.
+ * 
+ */
+typedef struct
+{
+  char * buf;       // capture buffer
+  int size;         // size of buffer
+  int len;          // characters captured so far
+  bool overflow;    // output was lost for lack of room
+  int (*cb_out)(int c); // if set, output is passed here as it comes, rather than kept in buf
+} Sink;
+
+#if UP_TIMERS || UP_BROADCAST
+/**
+ * @brief Where output went before switching to another session's, to switch back to, see selectOutput().
+ * 
+ */
+typedef struct
+{
+  uP_Session * s;           // session selected
+  int (*cb_out)(int c);     // its call-back
+  Sink * sink;              // output captured, if so
+} Output;
+#endif
 
 /**
  * @brief Structure that defines each shell command handler, including function pointer and help information.
@@ -75,774 +262,5763 @@ typedef struct
 {
     const char * cmd;
     void (*handler)(char const * const cmd, char const * const * param, int numParams);
+#if UP_FEATURE_HELP
     char const * help;
-    // future: list of string pointers, where strings are either space-separated parameter hints (e.g. "left middle right") or ghost hints
-    // as to the variable type expected (e.g. "<x coord>")
+#endif
+    // list of string pointers, one per parameter and ending with NULL, where strings are either space-separated parameter values
+    // (e.g. "left middle right"), for TAB completion, or ghost hints as to the variable type expected (e.g. "<x coord>")
     char const * const * hints;
+#if UP_FEATURE_STREAM
+    void (*stream)(char const * const cmd, char const * data, int len, bool final);   // streaming handler, in place of handler
+#endif
 } Cmd_struct;
 
+/**
+ * @brief A list of registered commands, shared by sessions, or a session's own.
+ * 
+ */
+typedef struct
+{
+  Cmd_struct * cmd;     // commands, as registered
+  int maxCmds;          // room in cmd[]
+  int numCmds;          // the number of commands registered, including the standard help
+  int numStreamCmds;    // number of streaming handlers registered
+  bool builtIns;        // built-in commands have been registered, "help" first
+  int listWidth;        // column width for listing commands, see listCommands()
+  int listNumCmds;      // numCmds when listWidth was worked out
+} Registry;
+
+#if UP_FEATURE_TAB && UP_FEATURE_HINTS
+/**
+ * @brief One parameter value listed in a command's hints, in the prefix index used for TAB completion.
+ * 
+ */
+typedef struct
+{
+  const char * word;    // value, within hint string - not null-terminated
+  unsigned char len;    // length of value
+  unsigned char param;  // parameter number, from 0
+  short cmdIdx;         // index of command
+} HintEntry;
+#endif
+
+#define ESCAPE_CHARS 7    // longest escape sequence recognized, plus null-terminator
+
+#if UP_BROADCAST
+/**
+ * @brief A line of output for every session, formatted once by uP_Broadcast(), then shared by reference from the queues of
+ * the sessions, until sent to the last of them.
+ * 
+ */
+typedef struct
+{
+  int refs;             // sessions yet to be sent the line, 0 if not in use
+  int len;              // characters of text
+  char text[MAX_BROADCAST_CHARS];   // line to send, without line end, which is each session's own
+} Broadcast;
+#endif
+
+/**
+ * @brief Everything about one terminal (or other source of input): its line, history and output, and modes of input.
+ * Buffers are either static (the default session) or carved from memory given to uP_Init().
+ * 
+ */
+struct uP_Session
+{
+  Registry * reg;               // commands recognized: the shared registry, or ownReg
+  Registry ownReg;              // session's own registry, if configured
+  char * lineBuf;               // line buffer
+  int lineSize;                 // size of line buffer, including null-terminator
+  int lineIdx;                  // next index in line buffer - also the count of characters in the line
+  int editIdx;                  // current edit index in line - -1 if not yet established for line
+  int lastChar;                 // previous character editted in line - -1 if none for line
+  char * histBuf;               // command history, as circular buffer of histDepth strings, each lineSize long
+  int histDepth;                // depth of recall history
+  int histIdx;                  // next index to fill in circular history string buffer
+  int histUsed;                 // history entries filled, so that reusing the session need clear only those
+  int recallIdx;                // history index recalled by up/down arrow - -1 if none for line
+  char * prompt;                // prompt to return to outgoing stream, or empty string if none
+  int promptSize;               // size of prompt buffer, including null-terminator
+  char outLineEnd[3];           // preferred line-end character(s) to output
+  char * outCharsBuf;           // buffer to hold stdout characters until return, if no call-back
+  int outSize;                  // characters outCharsBuf holds, not including null-terminator
+  int outCharIdx;               // next index into outCharsBuf[] - empty if zero
+  char * capBuf;                // captured command output, for a response frame or record
+  int capSize;                  // size of capture buffer
+  char escapeChars[ESCAPE_CHARS];   // escape sequence received so far
+  bool pasteEnabled;            // bracketed paste requested of the terminal, see uP_setBracketedPaste()
+  bool pasteModePending;        // bracketed paste enable/disable sequence still to be sent to the terminal
+  bool pasting;                 // between paste start and paste end markers
+  int deferIdx;                 // line index where un-echoed (deferred) characters begin - -1 if none
+  bool bursting;                // input is arriving faster than typed, so defer echo as for paste
+  unsigned int burstGapMs;      // characters arriving closer together than this are a burst, see uP_ProcessCharAt()
+  int burstBytes;               // blocks at least this long are a burst, see uP_ProcessChars()
+  unsigned long lastInputMs;    // time of the latest character given to uP_ProcessCharAt()
+  bool lastInputValid;          // lastInputMs has been set
+  bool machineMode;             // exchanging frames rather than editing lines
+  int frameState;               // progress receiving a request frame
+  int frameLen;                 // payload length given in request frame
+  int frameIdx;                 // payload characters received so far
+  uint16_t frameCrc;            // CRC calculated over the request frame so far
+  uint16_t frameRxCrc;          // CRC received with the request frame
+  int framePolledIdx;           // frame progress as of the last uP_Poll(), to detect a stalled frame
+  unsigned long framePolledMs;  // time of the last uP_Poll() that saw the frame progress
+  int responseMode;             // how interactive input is echoed and answered
+  int streamIdx;                // streaming handler receiving the rest of the line - -1 if none
+  int streamLen;                // characters in the streaming chunk, kept in the line buffer after the command
+  bool viCommand;               // in vi command mode, see UP_KEYMAP_VI
+  bool ghostShown;              // ghost hint shown after the cursor, see showGhostHint()
+  bool tabAmbiguous;            // previous key was a TAB that matched more than one command, so another lists them
+  int termWidth;                // terminal columns, see uP_setTerminalWidth()
+  unsigned long linesOut;       // line-feeds sent to the terminal, so a dashboard can tell when it has scrolled away
+#if UP_IDLE_TIMEOUTS
+  Timer idleTimer;              // due when the session may have been idle long enough to warn or end, see idleTimeout()
+  unsigned long idleMs;         // time without input after which the session ends, 0 for no limit
+  unsigned long idleWarnMs;     // time before the end to warn of it, 0 for no warning
+  unsigned long activeTick;     // wheel tick of the latest input
+  bool idleWarned;              // warning given, with no input since
+  void (*idleExpired)(uP_Session * session);    // called when the session ends for being idle
+  uP_Session * nextExpired;     // next session in g_expired, NULL if last
+#endif
+  int (*cb_out)(int c);         // call-back given with the latest call, for output at other times, as by a watch
+#if UP_VARIABLES
+  Variables * vars;             // variables, given to commands as $name - NULL if none, as configured
+#endif
+#if UP_SESSION_POOL
+  uP_Session * nextFree;        // next session free in the pool, most recently closed first
+  bool pooled;                  // session is free in the pool
+#endif
+#if UP_BROADCAST
+  uP_Session * nextSession;     // next session in g_sessions, NULL if last
+  uP_Session * prevSession;     // previous session in g_sessions, NULL if first
+  bool listed;                  // session is in g_sessions, to be sent broadcasts
+  Broadcast * bcast[MAX_BROADCAST_QUEUE];   // broadcasts waiting to be sent, oldest at bcastHead
+  unsigned char bcastHead;      // index of oldest broadcast in bcast[]
+  unsigned char bcastCount;     // broadcasts waiting in bcast[]
+#endif
+};
+
 #ifndef NUM_ELEMENTS
     #define NUM_ELEMENTS(array) (sizeof(array)/sizeof(array[0]))  ///< number of elements in array of objects
 #endif
 
 // Local prototypes.
-static void clearLine(void);
-static bool editLine(int extChar);
-static bool removeCharAtIndex(char * line, int idx);
+static bool editLine(int key);
+#if UP_FEATURE_KEYMAP
+static int viCommand(int key);
+#else
+static int keyAction(int key);
+#endif
+static void moveCursor(int idx);
+static void deleteChars(int from, int n);
+static int wordStart(int idx);
+#if UP_FEATURE_TAB || UP_FEATURE_HINTS
+static int scanLine(int * cmdStart, int * cmdLen, int * wordStart);
+#endif
+#if UP_FEATURE_TAB
+static void completeWord(void);
+static void listCommands(const char * prefix, int len);
+#endif
+#if UP_FEATURE_HINTS
+static int hintCommand(int cmdStart, int cmdLen, int param);
+static void showGhostHint(void);
+static void eraseGhostHint(void);
+#endif
+#if UP_FEATURE_TAB && UP_FEATURE_HINTS
+static int matchHint(int cmdIdx, int param, const char * prefix, int len, const char ** word);
+static void buildHintIndex(void);
+static int compareHints(const void * a, const void * b);
+#endif
+#if UP_FEATURE_HISTORY
+static void recallHistory(bool back);
+#endif
 static bool insertCharAtIndex(char * line, int idx, char c, int lineSize);
 static bool processLine(char * line);
+static char * tokenize(char * line, char const ** tok, int maxTok, int * numTok, bool vars);
+static int findCommand(const char * cmd);
+static bool dispatch(int idx, char const * const * tok, int numTok);
+#if UP_PARSE_CACHE
+static char * parseCached(char * line, char const ** tok, int * numTok, int * cmdIdx);
+static int commandLength(const char * line, uint32_t * hash);
+#endif
 static int processEscapes(char c);
 static void outChar(const char c);
 static bool isEmptyLine(const char * line);
+#if UP_FEATURE_TAB
 static int uniquePartialMatch(const char * str);
+#endif
+static void beginCall(int (*cb_out)(int c));
+static void registerBuiltIns(void);
+#if UP_FEATURE_SCRIPTS
+static int runScript(const char * script, int len, bool stopOnError);
+#endif
+#if UP_FEATURE_SCRIPTS || UP_SCRIPT_FILES
+static int runScriptLine(char * line, int lineNum, bool stopOnError);
+#endif
+#if UP_SCRIPT_FILES
+static int runScriptFile(const char * path, bool stopOnError);
+#endif
+#if UP_COMPILED_SCRIPTS
+static int compileScript(const char * script, int len, uP_Program * prog);
+static int compileStatement(uP_Program * prog, char const ** tok, int numTok, short * block, int * depth);
+static bool compileOperand(uP_Program * prog, const char * str, short * var, long * value);
+static int findProgramVar(const uP_Program * prog, const char * name);
+static const char * unknownVariable(const uP_Program * prog, char const * const * tok, int numTok);
+static int runProgram(uP_Program * prog);
+static void handle_run(char const * const cmd, char const * const * param, int numParams);
+#endif
+static char * endCall(void);
+static void processChar(const char c);
+static bool registerCmd(const char * cmd, void (*handler)(char const * const cmd, char const * const * param, int numParams),
+  void (*stream)(char const * const cmd, char const * data, int len, bool final), const char * help, char const * const * hints);
+#if UP_FEATURE_STREAM
+static bool startStream(void);
+static void streamChar(const char c);
+static void flushStream(bool final);
+static int streamCommand(char * line, char ** data, char ** next);
+#endif
+static void addHistory(const char * line);
+#if UP_FEATURE_HISTORY
+static char * histLine(int i);
+#endif
+#if UP_FEATURE_SESSIONS
+static void initSession(uP_Session * s, bool reused);
+static void endSession(uP_Session * s);
+static size_t alignUp(size_t n);
+static int historyDepth(const uP_Config * c);
+#if UP_VARIABLES
+static int variableTextSize(const uP_Config * c);
+#endif
+#endif
+#if UP_FEATURE_PASTE
+static void deferChar(char c);
+static void settleLine(void);
+#endif
+#if UP_FEATURE_MACHINE
+static void machineChar(const char c);
+static void sendFrame(int status, const char * payload, int len);
+static uint16_t crc16(uint16_t crc, uint8_t b);
+#endif
+static void rawChar(const char c);
+static int processLineCaptured(char * line, Sink * sink);
+static int execute(const char * line, Sink * sink);
+#if UP_TIMERS || UP_BROADCAST
+static void selectOutput(uP_Session * s, Output * prev);
+static void restoreOutput(const Output * prev);
+static void beginAsyncOutput(void);
+static void endAsyncOutput(void);
+#endif
+#if UP_BROADCAST
+static void listSession(uP_Session * s);
+static void releaseBroadcast(Broadcast * b);
+static void sendBroadcasts(void);
+#endif
+#if UP_TIMERS
+static void startTimer(Timer * t, unsigned long ms);
+static void stopTimer(Timer * t);
+static void runTimers(unsigned long ms);
+static void insertTimer(Timer * t);
+static void cascadeTimers(int level, int idx);
+#endif
+#if UP_IDLE_TIMEOUTS
+static void idleTimeout(void * arg);
+#endif
+#if UP_WATCH
+static void runWatch(void * arg);
+static void stopWatch(int w);
+static void runDashboard(Dashboard * d, char * line);
+static void handle_watch(char const * const cmd, char const * const * param, int numParams);
+static void handle_unwatch(char const * const cmd, char const * const * param, int numParams);
+#endif
+#if UP_PIPES
+static int pipeEnd(const char * str);
+static char * runPipe(char * line, bool * handled);
+static bool pipeStage(char const * const * tok, int numTok, Sink * sink);
+static int sliceLines(int start, int len);
+static bool sliceContains(const Slice * slice, const char * str, int len);
+#endif
+#if UP_FEATURE_JSON
+static void processLineJson(char * line);
+static void rawJsonString(const char * str, int len);
+#endif
 static void handle_unhandled(char const * const cmd, char const * const * param, int numParams);
+#if UP_FEATURE_SUGGEST
+static void suggestCommands(const char * cmd);
+static int editDistance(const uint32_t * peq, int m, const char * text, int maxDist);
+#endif
+#if UP_FEATURE_HELP
 static void handle_help(char const * const cmd, char const * const * param, int numParams);
-static void uP_printf(char * fmt, ...);
+#endif
+#if UP_FEATURE_DUMP
+static void handle_dump(char const * const cmd, char const * const * param, int numParams);
+#endif
+#if UP_SCRIPT_FILES
+static void handle_source(char const * const cmd, char const * const * param, int numParams);
+#endif
+#if UP_VARIABLES
+static uint32_t hashName(const char * name);
+static int findVariable(const char * name);
+static const char * variableValue(const char * tok);
+static bool setVariable(const char * name, char const * const * param, int numParams);
+static void deleteVariable(int v);
+static void indexVariables(void);
+static void handle_set(char const * const cmd, char const * const * param, int numParams);
+static void handle_unset(char const * const cmd, char const * const * param, int numParams);
+#endif
+#if UP_ALIASES
+static int findAlias(const char * name);
+static bool expandAlias(int a, char const * const * tok, int numTok);
+static bool defineAlias(const char * name, char const * const * param, int numParams);
+static void deleteAlias(int a);
+static void showAlias(int a);
+static void handle_alias(char const * const cmd, char const * const * param, int numParams);
+#endif
+static void uP_printf(const char * fmt, ...);
+static void outStr(const char * str, int len);
 
 // File globals.
-static char g_outLineEnd[3] = {0};              // preferred line-end character(s) to output
-static char g_prompt[MAX_SHELL_PROMPT+1] = {0}; // prompt to return to outgoing stream, or empty string if none
-static bool g_lineEndSet = false;               // set true only after line-end initialized
-static bool g_helpInitialized = false;          // help command list has been initialized, to include help handler
-static Cmd_struct g_cmd[MAX_COMMANDS] = { 0 };  // list of commands, as registered
-static int g_numRegCmds = 0;                    // the number of commands registered, including the standard help
-static void (*g_cb_out)(const char c) = NULL;   // if used, allows feeding characters to output through a call-back function - set to NULL if not used
+static Cmd_struct g_cmd[MAX_COMMANDS] = { 0 };  // list of commands, as registered, shared by sessions without their own
+static Registry g_sharedReg = { g_cmd, MAX_COMMANDS, 0, 0, false, 0, 0 };   // registry of the default session, and others sharing it
+static int (*g_cb_out)(int c) = NULL;           // if used, allows feeding characters to output through a call-back function - set to NULL if not used
 static char g_outCharsBuf[MAX_STR+1] = { 0 };   // buffer to hold stdout characters until return
-static int g_outCharIdx = 0;                    // next index into outCharBuf[] - empty if zero
 static char lineBuf[MAX_TOTAL_COMMAND_CHARS+1] = { 0 };   ///< line buffer
-static int lineIdx = 0;                                   ///< next index in line buffer - also the count of characters in the line
-static int editIdx = -1;                        ///< current edit index in line - -1 if not yet established for line
-static int lastChar = -1;                       ///< previous character editted in line - -1 if none for line
+#if UP_FEATURE_HISTORY
 static char histBuf[MAX_HISTORY][MAX_TOTAL_COMMAND_CHARS+1] = { 0 };  ///< command history, as circular string buffer
-static int histIdx = 0;                                               ///< next index to fill in circular history string buffer
+#endif
+static char g_prompt[MAX_SHELL_PROMPT+1] = {0}; // prompt to return to outgoing stream, or empty string if none
+#if UP_RESPONSES
+static char g_capBuf[MAX_RESPONSE_CHARS] = { 0 };   // captured command output, for a response frame or record
+#endif
+#if UP_VARIABLES
+static char g_defVarText[MAX_VARIABLE_TEXT];    // variable names and values of the default session
+static Variables g_defVars = { .textSize = MAX_VARIABLE_TEXT, .text = g_defVarText };  // variables of the default session
+#endif
+static uP_Session g_defSession =                // session used until another is selected, sized by the MAX_ defines - initial state as for initSession()
+{
+  .reg = &g_sharedReg,
+  .lineBuf = lineBuf,
+  .lineSize = sizeof(lineBuf),
+  .editIdx = -1,
+  .lastChar = -1,
+#if UP_FEATURE_HISTORY
+  .histBuf = &histBuf[0][0],
+  .histDepth = MAX_HISTORY,
+#endif
+  .recallIdx = -1,
+  .prompt = g_prompt,
+  .promptSize = sizeof(g_prompt),
+  .outLineEnd = "\r\n",
+  .outCharsBuf = g_outCharsBuf,
+  .outSize = MAX_STR,
+#if UP_RESPONSES
+  .capBuf = g_capBuf,
+  .capSize = sizeof(g_capBuf),
+#endif
+  .deferIdx = -1,
+  .burstGapMs = 10,
+  .burstBytes = 8,
+  .frameState = FRAME_SOF,
+  .framePolledIdx = -1,
+  .responseMode = UP_RESPONSE_TEXT,
+  .streamIdx = -1,
+  .termWidth = TERMINAL_WIDTH,
+#if UP_VARIABLES
+  .vars = &g_defVars,
+#endif
+#if UP_BROADCAST
+  .listed = true,
+#endif
+};
+static uP_Session * g_s = &g_defSession;        // session selected, whose input is being processed
+static int g_status = UP_STATUS_OK;             // status of latest command processed
+static Sink * g_sink = NULL;                    // if set, output is captured here rather than sent to the terminal
+static char g_noReturn[] = "";                  // returned by uP_ProcessChar() when there's nothing to return yet
+static char * g_charReturn = NULL;              // if set, returned by uP_ProcessChar() rather than output buffered, see processChar()
+#if UP_FEATURE_KEYMAP
+static unsigned char g_keymap[NUM_KEYS];       // editing action bound to each key, see uP_setKeymap()
+static bool g_keymapSet = false;                // g_keymap has been set to a preset
+#endif
+#if UP_FEATURE_TAB && UP_FEATURE_HINTS
+static HintEntry g_hintIndex[MAX_HINT_WORDS];   // parameter values of all commands, sorted for prefix search
+static int g_numHints = 0;                      // values in g_hintIndex
+static Registry * g_hintReg = NULL;             // registry g_hintIndex was built from
+static int g_hintNumCmds = 0;                   // commands registered when g_hintIndex was built
+#endif
+#if UP_FEATURE_SCRIPTS || UP_SCRIPT_FILES
+static int g_scriptDepth = 0;                   // scripts running, to stop a script that sources itself
+#endif
+#if UP_PIPES
+static char g_pipeBuf[MAX_PIPE_CHARS];          // output of commands in a pipe
+static Slice g_pipeSlice[MAX_PIPE_LINES];       // lines of output passed from one stage of a pipe to the next
+static int g_numSlices = 0;                     // lines in g_pipeSlice[]
+static bool g_piping = false;                   // running a pipe, which can't be done within another
+#endif
+#if UP_TIMERS
+static Timer * g_wheel[WHEEL_LEVELS * WHEEL_SLOTS]; // first timer in each slot of the wheel, NULL if none
+static bool g_wheelStarted = false;             // g_wheelMs has been set from the clock given to uP_Poll()
+static unsigned long g_wheelBase = 0;           // first tick run, taken from the clock when the wheel started
+static unsigned long g_wheelTick = 0;           // latest tick run
+static unsigned long g_wheelMs = 0;             // time of g_wheelTick, from the clock given to uP_Poll()
+#endif
+#if UP_WATCH
+static Watch g_watch[MAX_WATCHES];              // watches, of all sessions
+static Dashboard g_dash[MAX_DASHBOARDS];        // dashboards, of watches of all sessions
+static char g_dashBuf[MAX_DASHBOARD_CHARS];     // output of the dashboard being refreshed
+static unsigned long g_dashRefreshes = 0;       // dashboards refreshed, over all sessions
+static unsigned long g_dashSent = 0;            // characters sent refreshing dashboards
+static unsigned long g_dashSaved = 0;           // characters saved refreshing dashboards, against drawing in full
+#endif
+#if UP_ALIASES
+static Alias g_alias[MAX_ALIASES];              // aliases, in the order defined
+static unsigned short g_aliasTok[MAX_ALIAS_TOKENS]; // offset in g_aliasText[] of each token of each alias, or ALIAS_END
+static char g_aliasText[MAX_ALIAS_TEXT];        // alias names and tokens, null-terminated, in the order defined
+static int g_numAliases = 0;                    // aliases in g_alias[]
+static int g_aliasNumTok = 0;                   // entries used in g_aliasTok[]
+static int g_aliasTextLen = 0;                  // characters used in g_aliasText[]
+static int g_aliasDepth = 0;                    // aliases being expanded, one within another
+static unsigned long g_aliasExpansions = 0;     // aliases expanded
+static int g_aliasMaxDepth = 0;                 // deepest nesting of aliases expanded
+static unsigned long g_aliasTooDeep = 0;        // aliases not expanded for nesting too deep
+#endif
+#if UP_IDLE_TIMEOUTS
+static uP_Session * g_expired = NULL;           // sessions ended for being idle, whose idleExpired() is still to be called
+#endif
+#if UP_BROADCAST
+static uP_Session * g_sessions = &g_defSession; // sessions set up and not ended, the default session first
+static Broadcast g_bcast[MAX_BROADCASTS];       // broadcasts, each in use until sent to every session
+static int g_bcastQueued = 0;                   // broadcasts waiting in queues of sessions, counting each session
+#endif
+#if UP_SESSION_POOL
+static char * g_poolMem = NULL;                 // memory of the session pool, see uP_InitSessionPool()
+static size_t g_poolSlotSize = 0;               // memory taken by each session of the pool
+static int g_poolSlots = 0;                     // sessions the pool holds
+static int g_poolCarved = 0;                    // sessions set up in the pool's memory so far, from the start
+static uP_Config g_poolConfig;                  // sizes of each session of the pool
+static uP_Session * g_poolFree = NULL;          // sessions closed, most recently closed first
+static int g_poolInUse = 0;                     // sessions open
+static unsigned long g_poolOpens = 0;           // sessions opened
+static unsigned long g_poolWarm = 0;            // sessions opened by reusing one closed
+static unsigned long g_poolRefused = 0;         // sessions not opened, for all being open
+#endif
+#if UP_PARSE_CACHE
+static ParseCacheEntry g_parseCache[UP_PARSE_CACHE];    // recently parsed commands
+static Registry * g_parseCacheReg = &g_sharedReg;       // registry the cached command indexes refer to
+static unsigned short g_parseCacheClock = 0;    // counts look-ups, to age entries
+static unsigned long g_parseCacheHits = 0;      // look-ups found in cache
+static unsigned long g_parseCacheMisses = 0;    // look-ups parsed afresh
+#endif
+
+#if UP_FEATURE_SESSIONS
+/**
+ * @brief Work out how much memory uP_Init() needs for a session of the given configuration.
+ * 
+ * @param config sizes for the session, or NULL for the MAX_ defines
+ * @return size_t bytes needed
+ */
+size_t uP_RequiredMemory(const uP_Config * config)
+{
+  uP_Config c = { 0 };
+  if (config)
+    c = *config;
+  int line = ((c.maxLine > 0) ? c.maxLine : MAX_TOTAL_COMMAND_CHARS) + 1;
+  int history = historyDepth(&c);
+
+  return alignUp(1)   // worst case, to align the start of the session
+    + alignUp(sizeof(uP_Session))
+    + alignUp((c.maxCommands > 0) ? c.maxCommands * sizeof(Cmd_struct) : 0)
+#if UP_VARIABLES
+    + ((variableTextSize(&c) > 0) ? alignUp(sizeof(Variables)) + variableTextSize(&c) : 0)
+#endif
+    + line
+    + history * line
+    + ((c.maxPrompt > 0) ? c.maxPrompt : MAX_SHELL_PROMPT) + 1
+    + ((c.maxOutput > 0) ? c.maxOutput : MAX_STR) + 1
+#if UP_RESPONSES
+    + ((c.maxResponse > 0) ? c.maxResponse : MAX_RESPONSE_CHARS)
+#endif
+    ;
+}
+
+/**
+ * @brief Set up a session in memory given by the caller, with the line buffer, history, prompt, output buffers and
+ * (optionally) its own command registry sized as configured, rather than by the MAX_ defines. Select it with
+ * uP_SelectSession() to process its input. Nothing is allocated, and the memory is in use until the session is
+ * ended by uP_EndSession().
+ * 
+ * @param mem memory for the session, at least uP_RequiredMemory(config) bytes, any alignment
+ * @param size bytes of memory given
+ * @param config sizes for the session, or NULL for the MAX_ defines
+ * @return uP_Session* session, or NULL if the memory given is too small
+ */
+uP_Session * uP_Init(void * mem, size_t size, const uP_Config * config)
+{
+  uP_Config c = { 0 };
+  if (config)
+    c = *config;
+  if ((mem == NULL) || (size < uP_RequiredMemory(config)))
+    return NULL;
+
+  // Carve the session up, aligned structures first, then strings.
+  char * p = (char *)mem + (alignUp((uintptr_t)mem) - (uintptr_t)mem);
+  uP_Session * s = (uP_Session *)p;
+  p += alignUp(sizeof(uP_Session));
+  memset(s, 0, sizeof(*s));
+
+  s->reg = &g_sharedReg;
+  if (c.maxCommands > 0)
+  {
+    s->ownReg.cmd = (Cmd_struct *)p;
+    s->ownReg.maxCmds = c.maxCommands;
+    s->reg = &s->ownReg;
+    p += alignUp(c.maxCommands * sizeof(Cmd_struct));
+  }
+
+#if UP_VARIABLES
+  int varText = variableTextSize(&c);
+  if (varText > 0)
+  {
+    s->vars = (Variables *)p;
+    s->vars->textSize = varText;
+    p += alignUp(sizeof(Variables));
+  }
+#endif
+
+  s->lineSize = ((c.maxLine > 0) ? c.maxLine : MAX_TOTAL_COMMAND_CHARS) + 1;
+  s->lineBuf = p;
+  p += s->lineSize;
+
+  s->histDepth = historyDepth(&c);
+  s->histBuf = p;
+  p += s->histDepth * s->lineSize;
+
+  s->promptSize = ((c.maxPrompt > 0) ? c.maxPrompt : MAX_SHELL_PROMPT) + 1;
+  s->prompt = p;
+  p += s->promptSize;
+
+  s->outSize = (c.maxOutput > 0) ? c.maxOutput : MAX_STR;
+  s->outCharsBuf = p;
+  p += s->outSize + 1;
+
+#if UP_RESPONSES
+  s->capSize = (c.maxResponse > 0) ? c.maxResponse : MAX_RESPONSE_CHARS;
+  s->capBuf = p;
+  p += s->capSize;
+#endif
+
+#if UP_VARIABLES
+  if (s->vars)
+    s->vars->text = p;
+#endif
+
+  initSession(s, false);
+#if UP_BROADCAST
+  listSession(s);
+#endif
+  return s;
+}
+
+/**
+ * @brief Select the session that following calls apply to: processing of input, settings such as the prompt, and
+ * registration of commands, if the session has a registry of its own.
+ * 
+ * @param session session set up by uP_Init(), or NULL for the default session, sized by the MAX_ defines
+ * @return uP_Session* session selected before, to restore later if need be
+ */
+uP_Session * uP_SelectSession(uP_Session * session)
+{
+  uP_Session * prev = g_s;
+  g_s = (session != NULL) ? session : &g_defSession;
+  return prev;
+}
+
+/**
+ * @brief End a session, before its memory is reused: stop its watches and idle timeout, and if it is selected, select the
+ * default session in its place.
+ * 
+ * @param session session set up by uP_Init(), or NULL for the default session
+ */
+void uP_EndSession(uP_Session * session)
+{
+  UP_LOCK();
+  endSession((session != NULL) ? session : &g_defSession);
+  UP_UNLOCK();
+}
+
+/**
+ * @brief End a session, leaving nothing running that refers to it. See uP_EndSession().
+ * 
+ * @param s session
+ */
+static void endSession(uP_Session * s)
+{
+#if UP_WATCH
+  int w;
+  for (w=0;w<MAX_WATCHES;w++)
+    if (g_watch[w].session == s)
+      stopWatch(w);
+#endif
+#if UP_IDLE_TIMEOUTS
+  stopTimer(&s->idleTimer);
+  s->idleMs = 0;
+#endif
+#if UP_BROADCAST
+  // Let go of broadcasts not yet sent, and stop sending more, unless this is the default session, which never ends.
+  while (s->bcastCount > 0)
+  {
+    releaseBroadcast(s->bcast[s->bcastHead]);
+    s->bcastHead = (s->bcastHead + 1) % MAX_BROADCAST_QUEUE;
+    s->bcastCount--;
+  }
+  if (s->listed && (s != &g_defSession))
+  {
+    if (s->prevSession)
+      s->prevSession->nextSession = s->nextSession;
+    else
+      g_sessions = s->nextSession;
+    if (s->nextSession)
+      s->nextSession->prevSession = s->prevSession;
+    s->listed = false;
+  }
+#endif
+  if (g_s == s)
+    g_s = &g_defSession;
+}
+
+#if UP_SESSION_POOL
+/**
+ * @brief Set up a pool of sessions of one configuration in memory given by the caller, for sessions opened and closed
+ * often, as by clients connecting briefly. Sessions are carved from the memory as first needed, and once closed, reused
+ * most recently closed first, while still warm in cache, with only what they used cleared. Any previous pool is
+ * forgotten, so close its sessions first.
+ * 
+ * @param mem memory for the sessions, any alignment
+ * @param size bytes of memory given - each session takes uP_RequiredMemory(config) bytes, rounded up to align
+ * @param config sizes for each session, or NULL for the MAX_ defines
+ * @return int sessions the pool holds
+ */
+int uP_InitSessionPool(void * mem, size_t size, const uP_Config * config)
+{
+  UP_LOCK();
+  memset(&g_poolConfig, 0, sizeof(g_poolConfig));
+  if (config)
+    g_poolConfig = *config;
+  g_poolMem = (char *)mem;
+  g_poolSlotSize = alignUp(uP_RequiredMemory(config));
+  g_poolSlots = (mem != NULL) ? (int)(size / g_poolSlotSize) : 0;
+  g_poolCarved = 0;
+  g_poolFree = NULL;
+  g_poolInUse = 0;
+  UP_UNLOCK();
+  return g_poolSlots;
+}
+
+/**
+ * @brief Open a session from the pool set up by uP_InitSessionPool(), in its initial state, as from uP_Init().
+ * 
+ * @return uP_Session* session, or NULL if all the pool's sessions are open
+ */
+uP_Session * uP_OpenSession(void)
+{
+  uP_Session * s = NULL;
+
+  UP_LOCK();
+  if (g_poolFree != NULL)
+  {
+    // Reuse the session closed most recently, leaving its memory carved as it is.
+    s = g_poolFree;
+    g_poolFree = s->nextFree;
+    s->pooled = false;
+    if (s->reg == &s->ownReg)
+    {
+      s->ownReg.numCmds = 0;
+      s->ownReg.numStreamCmds = 0;
+      s->ownReg.builtIns = false;
+      s->ownReg.listNumCmds = 0;
+#if UP_PARSE_CACHE
+      if (g_parseCacheReg == &s->ownReg)
+        memset(g_parseCache, 0, sizeof(g_parseCache));
+#endif
+#if UP_FEATURE_TAB && UP_FEATURE_HINTS
+      if (g_hintReg == &s->ownReg)
+        g_hintReg = NULL;
+#endif
+    }
+    initSession(s, true);
+#if UP_BROADCAST
+    listSession(s);
+#endif
+    g_poolWarm++;
+  } else if (g_poolCarved < g_poolSlots)
+  {
+    s = uP_Init(g_poolMem + g_poolCarved * g_poolSlotSize, g_poolSlotSize, &g_poolConfig);
+    g_poolCarved++;
+  }
+
+  if (s != NULL)
+  {
+    g_poolOpens++;
+    g_poolInUse++;
+  } else
+  {
+    g_poolRefused++;
+  }
+  UP_UNLOCK();
+  return s;
+}
+
+/**
+ * @brief Close a session opened by uP_OpenSession(), ending it as by uP_EndSession(), and return it to the pool.
+ * Closing a session twice, or one not from the pool, does nothing. Takes the lock (see UP_LOCK), so from a handler, which
+ * runs with the lock held, needs a recursive lock - but not from the call-back of uP_setIdleTimeout(), which runs without.
+ * 
+ * @param session session to close
+ */
+void uP_CloseSession(uP_Session * session)
+{
+  char * p = (char *)session;
+
+  UP_LOCK();
+  if ((session != NULL) && (p >= g_poolMem) && (p < g_poolMem + g_poolCarved * g_poolSlotSize) && !session->pooled)
+  {
+    endSession(session);
+    session->pooled = true;
+    session->nextFree = g_poolFree;
+    g_poolFree = session;
+    g_poolInUse--;
+  }
+  UP_UNLOCK();
+}
+
+/**
+ * @brief Get statistics of the session pool. The hit rate is warm / opens: the share of sessions opened by reusing one
+ * closed, rather than carving a new one.
+ * 
+ * @param opens if not NULL, set to the number of sessions opened
+ * @param warm if not NULL, set to the number of sessions opened by reusing one closed
+ * @param refused if not NULL, set to the number of sessions not opened, for all being open
+ * @param inUse if not NULL, set to the number of sessions open now
+ */
+void uP_getSessionPoolStats(unsigned long * opens, unsigned long * warm, unsigned long * refused, int * inUse)
+{
+  if (opens)
+    *opens = g_poolOpens;
+  if (warm)
+    *warm = g_poolWarm;
+  if (refused)
+    *refused = g_poolRefused;
+  if (inUse)
+    *inUse = g_poolInUse;
+}
+#endif
+
+/**
+ * @brief Put a session in its initial state, with empty line, history and prompt, as for g_defSession.
+ * A session reused, as from the pool, has only the history entries it filled cleared, since a history entry is empty if
+ * its first character is.
+ * 
+ * @param s session, with buffers and sizes already set
+ * @param reused true if the session was in use before, so that its buffers are as it left them
+ */
+static void initSession(uP_Session * s, bool reused)
+{
+  int i;
+
+  s->lineBuf[0] = '\0';
+  s->lineIdx = 0;
+  s->editIdx = -1;
+  s->lastChar = -1;
+  if (reused)
+  {
+    for (i=0;i<s->histUsed;i++)
+      s->histBuf[i * s->lineSize] = '\0';
+    s->prompt[0] = '\0';
+  } else
+  {
+    if (s->histDepth > 0)
+      memset(s->histBuf, 0, s->histDepth * s->lineSize);
+    memset(s->prompt, 0, s->promptSize);
+  }
+  s->histIdx = 0;
+  s->histUsed = 0;
+  s->recallIdx = -1;
+#if UP_VARIABLES
+  if (s->vars)
+  {
+    if (!reused || (s->vars->numVars > 0))
+      memset(s->vars->index, 0, sizeof(s->vars->index));
+    s->vars->numVars = 0;
+    s->vars->textLen = 0;
+  }
+#endif
+  strcpy(s->outLineEnd, "\r\n");
+  s->outCharIdx = 0;
+  memset(s->escapeChars, 0, sizeof(s->escapeChars));
+  s->pasteEnabled = false;
+  s->pasteModePending = false;
+  s->pasting = false;
+  s->deferIdx = -1;
+  s->bursting = false;
+  s->burstGapMs = 10;
+  s->burstBytes = 8;
+  s->lastInputValid = false;
+  s->machineMode = false;
+  s->frameState = FRAME_SOF;
+  s->framePolledIdx = -1;
+  s->responseMode = UP_RESPONSE_TEXT;
+  s->streamIdx = -1;
+  s->streamLen = 0;
+  s->viCommand = false;
+  s->ghostShown = false;
+  s->tabAmbiguous = false;
+  s->termWidth = TERMINAL_WIDTH;
+  s->linesOut = 0;
+}
+
+/**
+ * @brief Depth of history for a session configuration.
+ * 
+ * @param c configuration
+ * @return int lines of history, 0 if none
+ */
+static int historyDepth(const uP_Config * c)
+{
+#if UP_FEATURE_HISTORY
+  return (c->maxHistory > 0) ? c->maxHistory : ((c->maxHistory < 0) ? 0 : MAX_HISTORY);
+#else
+  (void)c;
+  return 0;
+#endif
+}
+
+#if UP_VARIABLES
+/**
+ * @brief Room for variable names and values for a session configuration.
+ * 
+ * @param c configuration
+ * @return int characters of variable text, 0 if the session has no variables
+ */
+static int variableTextSize(const uP_Config * c)
+{
+  return (c->maxVariableText > 0) ? c->maxVariableText : ((c->maxVariableText < 0) ? 0 : MAX_VARIABLE_TEXT);
+}
+#endif
+
+/**
+ * @brief Round up to the alignment needed by any structure carved from session memory.
+ * 
+ * @param n size or address
+ * @return size_t n, rounded up
+ */
+static size_t alignUp(size_t n)
+{
+  const size_t align = (sizeof(void *) > sizeof(long)) ? sizeof(void *) : sizeof(long);
+  return (n + align - 1) / align * align;
+}
+#endif
+
+bool uP_RegisterHandler(const char * cmd, void (*handler)(char const * const cmd, char const * const * param, int numParams), const char * help, char const * const * hints)
+{
+  // Fail-safe: ignore and return failure if handler pointer is null.
+  if (handler == NULL)
+    return false;
+
+  return registerCmd(cmd, handler, NULL, help, hints);
+}
+
+#if UP_FEATURE_STREAM
+/**
+ * @brief Register a streaming handler, for commands whose data may be larger than the line buffer, such as long hex strings.
+ * Once the command and a space have been typed, the rest of the line is delivered to the handler in chunks as it arrives,
+ * without line editing, echo or history, and in constant memory (the part of the line buffer after the command), so the data
+ * may be any length. The last call for a line has final set (with a zero-length chunk, if the data ended with the last chunk).
+ * If the line is cancelled with ctrl-C, the handler is called with data NULL and final set.
+ * From a script, machine-mode frame or other source of complete lines, the rest of the line (including any ';') is delivered
+ * as a single, final chunk.
+ * 
+ * @param cmd command string
+ * @param stream handler, given the command, next chunk of data and its length, and whether this is the last chunk for the line
+ * @param help help string
+ * @return true if registered
+ */
+bool uP_RegisterStreamHandler(const char * cmd, void (*stream)(char const * const cmd, char const * data, int len, bool final), const char * help)
+{
+  if (stream == NULL)
+    return false;
+
+  if (!registerCmd(cmd, NULL, stream, help, NULL))
+    return false;
+  g_s->reg->numStreamCmds++;
+  return true;
+}
+#endif
+
+/**
+ * @brief Add a command to the g_s->reg->cmd table, see uP_RegisterHandler().
+ * 
+ * @param cmd command string
+ * @param handler handler, or NULL for a streaming handler
+ * @param stream streaming handler, or NULL for a regular handler
+ * @param help help string
+ * @param hints parameter hints
+ * @return true if registered
+ */
+static bool registerCmd(const char * cmd, void (*handler)(char const * const cmd, char const * const * param, int numParams),
+  void (*stream)(char const * const cmd, char const * data, int len, bool final), const char * help, char const * const * hints)
+{
+  // Fail-safe: check for max. Ignore and retun failure if full.
+  if (g_s->reg->numCmds >= g_s->reg->maxCmds)
+    return false;
+
+  // If first time called, then initialize list to include a "help" handler (and any other built-in handlers).
+  if (!g_s->reg->builtIns)
+    registerBuiltIns();
+
+  // Fail-safe: check again, in case built-ins filled the list.
+  if (g_s->reg->numCmds >= g_s->reg->maxCmds)
+    return false;
+
+  g_s->reg->cmd[g_s->reg->numCmds].cmd = cmd;
+  g_s->reg->cmd[g_s->reg->numCmds].handler = handler;
+#if UP_FEATURE_STREAM
+  g_s->reg->cmd[g_s->reg->numCmds].stream = stream;
+#else
+  (void)stream;
+#endif
+#if UP_FEATURE_HELP
+  g_s->reg->cmd[g_s->reg->numCmds].help = help;
+#else
+  (void)help;
+#endif
+  g_s->reg->cmd[g_s->reg->numCmds].hints = hints;
+
+#if UP_PARSE_CACHE
+  // A command cached as unknown may be known now.
+  memset(g_parseCache, 0, sizeof(g_parseCache));
+#endif
+
+  // Count commands, and return success.
+  g_s->reg->numCmds++;
+  return true;
+}
+
+/**
+ * @brief Call with each character received from an input stream, one character per call.
+ * Recognizes and processes commands with parameters (based on handlers registered), with each line ending with one or more line-end characters.
+ * Recognizes and handles backspace characters and escape sequences.
+ * Uses cb_out call-back to echo received, and process backspace and escape sequences.
+ * 
+ * @param c ASCIIZ character that is next in stdin stream of characters to process
+ * @param cb_out call-back to stdout stream - putchar works nicely, if available
+ * @return char* ASCIIZ string received, or empty string if complete string and line-end not received yet
+ */
+char * uP_ProcessChar(const char c, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  processChar(c);
+
+  // Up and down arrow return the line recalled, and input taken in without editing (mid escape sequence, pasting) returns
+  // nothing, with any output left buffered for a later call, as this always has. Otherwise, return output buffered.
+  char * ret = g_charReturn;
+  if (ret == NULL)
+    return endCall();
+  UP_UNLOCK();
+  return ret;
+}
+
+/**
+ * @brief Same as uP_ProcessChar(), but for a block of characters delivered together, as from a read() of a serial port or socket.
+ * A block of at least the burst size set by uP_setBurstDetect() is taken to be pasted or otherwise machine-sent text, rather
+ * than typed, so echo and redraw are deferred until each line ends, or until the end of the block.
+ * A call-back should be given, since output buffered for return is limited to MAX_STR characters.
+ * 
+ * @param str characters to process, need not be null-terminated
+ * @param len number of characters in str
+ * @param cb_out call-back to stdout stream
+ * @return char* any output buffered if no call-back given, otherwise empty string
+ */
+char * uP_ProcessChars(const char * str, int len, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+
+#if UP_FEATURE_PASTE
+  // Burst for the length of this block only, unless already bursting based on timestamps.
+  bool wasBursting = g_s->bursting;
+  if ((g_s->burstBytes > 0) && (len >= g_s->burstBytes))
+    g_s->bursting = true;
+#endif
+
+  int i;
+  for (i=0;i<len;i++)
+    processChar(str[i]);
+
+#if UP_FEATURE_PASTE
+  g_s->bursting = wasBursting;
+  if (!g_s->bursting && !g_s->pasting)
+    settleLine();
+#endif
+
+#if UP_FEATURE_STREAM
+  // Pass on whatever streaming data arrived, rather than wait for the chunk to fill.
+  if ((g_s->streamIdx >= 0) && (g_s->streamLen > 0))
+    flushStream(false);
+#endif
+  return endCall();
+}
+
+#if UP_FEATURE_PASTE
+/**
+ * @brief Same as uP_ProcessChar(), but with the time the character was received, used to detect bursts of input arriving faster
+ * than anyone types, as when pasting into a terminal that does not support bracketed paste. Echo and redraw are deferred during
+ * the burst, and the settled line is echoed once the burst ends. Since the end of a burst is only evident by the lack of another
+ * character, callers using this should also call uP_Poll() periodically while idle.
+ * 
+ * @param c character that is next in stdin stream of characters to process
+ * @param ms time received, in milliseconds, from any free-running clock (wraps harmlessly)
+ * @param cb_out call-back to stdout stream
+ * @return char* any output buffered if no call-back given, otherwise empty string
+ */
+char * uP_ProcessCharAt(const char c, unsigned long ms, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+
+  // A character hard on the heels of the last one starts or continues a burst, otherwise ends it.
+  // Ending a burst settles the line on the way through processChar(), before the character is edited.
+  g_s->bursting = (g_s->burstGapMs > 0) && g_s->lastInputValid && ((ms - g_s->lastInputMs) < g_s->burstGapMs);
+  g_s->lastInputMs = ms;
+  g_s->lastInputValid = true;
+
+  processChar(c);
+  return endCall();
+}
+#endif
+
+/**
+ * @brief Call periodically while no input is arriving, for housekeeping based on time. This ends a burst of input
+ * detected by uP_ProcessCharAt() once the input goes quiet, echoing the settled line, passes on any partial chunk of
+ * streaming data, runs watches and idle timeouts due and sends broadcasts waiting (of every session, each to its own
+ * output), and abandons any machine-mode frame stalled for 100ms or more. Call at least every UP_TICK_MS when watches or idle timeouts are running.
+ * 
+ * @param ms current time in milliseconds, from the same clock given to uP_ProcessCharAt()
+ * @param cb_out call-back to stdout stream
+ * @return char* any output buffered if no call-back given, otherwise empty string
+ */
+char * uP_Poll(unsigned long ms, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  (void)ms;
+
+#if UP_FEATURE_PASTE
+  if (g_s->bursting && ((ms - g_s->lastInputMs) >= g_s->burstGapMs))
+  {
+    g_s->bursting = false;
+    if (!g_s->pasting)
+      settleLine();
+  }
+#endif
+
+#if UP_FEATURE_STREAM
+  // Pass on whatever streaming data has arrived, rather than wait for the chunk to fill.
+  if ((g_s->streamIdx >= 0) && (g_s->streamLen > 0))
+    flushStream(false);
+#endif
+
+#if UP_TIMERS
+  // Run watches and idle timeouts due, of any session.
+  runTimers(ms);
+#endif
+#if UP_BROADCAST
+  // Send broadcasts waiting, to any session.
+  sendBroadcasts();
+#endif
+
+#if UP_FEATURE_MACHINE
+  // Abandon a machine-mode frame that has made no progress for a while, so a lost byte can't wedge the receiver.
+  if (g_s->machineMode && (g_s->frameState != FRAME_SOF))
+  {
+    int progress = (g_s->frameState << 16) + g_s->frameIdx;
+    if (progress != g_s->framePolledIdx)
+    {
+      g_s->framePolledIdx = progress;
+      g_s->framePolledMs = ms;
+    } else if ((ms - g_s->framePolledMs) >= 100)
+    {
+      g_s->frameState = FRAME_SOF;
+    }
+  }
+#endif
+
+#if UP_IDLE_TIMEOUTS
+  // Tell of sessions ended for being idle once the lock is given up, so that each may be closed or set up again from the
+  // call-back without taking the lock again.
+  uP_Session * expired = g_expired;
+  g_expired = NULL;
+  char * out = endCall();
+  while (expired != NULL)
+  {
+    uP_Session * s = expired;
+    expired = s->nextExpired;
+    s->idleExpired(s);
+  }
+  return out;
+#else
+  return endCall();
+#endif
+}
+
+#if UP_FEATURE_PASTE
+/**
+ * @brief Set how bursts of input (paste from a terminal without bracketed paste) are detected.
+ * 
+ * @param gapMs input arriving less than this many milliseconds apart is a burst, when using uP_ProcessCharAt() - 0 to disable
+ * @param minBytes blocks of at least this many characters given to uP_ProcessChars() are a burst - 0 to disable
+ */
+void uP_setBurstDetect(unsigned int gapMs, int minBytes)
+{
+  g_s->burstGapMs = gapMs;
+  g_s->burstBytes = minBytes;
+}
+#endif
+
+#if UP_FEATURE_SCRIPTS
+/**
+ * @brief Run a script of commands, one command line per line, through the same processing as interactive input, but without
+ * echo, prompt or line editing. The script may be in any memory, such as a buffer received from a host, or a file mapped
+ * into memory, and is not modified. Blank lines and lines starting with '#' are ignored. Each line is limited to
+ * MAX_TOTAL_COMMAND_CHARS, as for interactive input.
+ * 
+ * @param script text of script, with lines ending in c/r, l/f or both - need not be null-terminated
+ * @param len number of characters in script
+ * @param stopOnError true to stop at the first command that fails, reporting the line number
+ * @param cb_out call-back to stdout stream, for command output - required, since output is not buffered for return as it is
+ * by uP_ProcessChar(), so is lost if NULL
+ * @return int status of the first command to fail, or UP_STATUS_OK if none
+ */
+int uP_RunScript(const char * script, int len, bool stopOnError, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  int status = runScript(script, len, stopOnError);
+  endCall();
+  return status;
+}
+#endif
+
+/**
+ * @brief Run a command line directly, as from test code or a remote procedure call, capturing its output. The line is
+ * split and dispatched as a line typed at the console would be (with ';', aliases, variables and pipes), but without
+ * touching the line editor, history, echo or prompt of the session, so it may be used while someone is part way through
+ * typing a line. Any session selected by uP_SelectSession() supplies the commands. For calls from another thread or
+ * interrupt context than the console, define UP_LOCK() and UP_UNLOCK().
+ * 
+ * @param line command line, not modified - limited to MAX_TOTAL_COMMAND_CHARS, whatever the session's maxLine
+ * @param out receives output, null-terminated - output that doesn't fit is lost
+ * @param size size of out, including room for the null-terminator
+ * @param outLen receives number of characters of output, or NULL if not wanted
+ * @return int status of the first command to fail, UP_STATUS_OVERFLOW if all succeeded but the line was too long or output
+ * was lost, or UP_STATUS_OK
+ */
+int uP_Execute(const char * line, char * out, int size, int * outLen)
+{
+  Sink sink = { out, (size > 0) ? size - 1 : 0, 0, false, NULL };
+  int status = execute(line, &sink);
+
+  if (size > 0)
+    out[sink.len] = '\0';
+  if (outLen)
+    *outLen = sink.len;
+  return status;
+}
+
+/**
+ * @brief Run a command line directly, as uP_Execute() does, but passing its output to a call-back as it comes, rather than
+ * capturing it, so output may be any length.
+ * 
+ * @param line command line, not modified - limited to MAX_TOTAL_COMMAND_CHARS, whatever the session's maxLine
+ * @param cb_out call-back to output stream
+ * @return int status of the first command to fail, UP_STATUS_OVERFLOW if the line was too long, or UP_STATUS_OK
+ */
+int uP_ExecuteTo(const char * line, int (*cb_out)(int c))
+{
+  Sink sink = { NULL, 0, 0, false, cb_out };
+  return execute(line, &sink);
+}
+
+/**
+ * @brief Run a command line directly, for uP_Execute() and uP_ExecuteTo(). The line is copied, since it is modified as it is
+ * split, into a buffer of MAX_TOTAL_COMMAND_CHARS on the stack, since the session's own line buffer may hold a line being
+ * typed. The status of the latest command (as seen by the console) is left as it was.
+ * 
+ * @param line command line
+ * @param sink where output goes
+ * @return int status of the first command to fail, UP_STATUS_OVERFLOW if all succeeded but the line was too long or output
+ * was lost, or UP_STATUS_OK
+ */
+static int execute(const char * line, Sink * sink)
+{
+  char buf[MAX_TOTAL_COMMAND_CHARS+1];
+  int len = strlen(line);
+  int status = UP_STATUS_OVERFLOW;
+
+  UP_LOCK();
+  int prevStatus = g_status;
+  if (!g_s->reg->builtIns)
+    registerBuiltIns();
+  if (len < (int)sizeof(buf))
+  {
+    memcpy(buf, line, len + 1);
+    status = processLineCaptured(buf, sink);
+  }
+  g_status = prevStatus;
+  UP_UNLOCK();
+  return status;
+}
+
+#if UP_COMPILED_SCRIPTS
+/**
+ * @brief Compile a script once, for running any number of times with uP_RunProgram(), at the speed of calling handlers directly.
+ * Commands are looked up when compiled, and their parameters split, so none of that is repeated when run.
+ * Statements are separated by line-ends or ';', as for uP_RunScript(). Besides commands, statements may be:
+ *   repeat <count>                 run the following statements, up to the matching end, count times
+ *   if ok | if fail                run the following statements, up to the matching else or end, if the previous command
+ *                                  succeeded (or failed)
+ *   else                           run the following statements, up to the matching end, if the if block was not run
+ *   end                            end a repeat, if or else block
+ *   let <var> <a> [+|- <b>]        set a variable to a number, or the sum or difference of two
+ * where any number may be given as $<var>, as may any parameter of a command, substituted with the variable's value when run.
+ * Blocks may nest up to MAX_PROGRAM_DEPTH deep. Lines starting with '#' are comments.
+ * Errors are reported with their line number.
+ * 
+ * @param script text of script - need not be null-terminated
+ * @param len number of characters in script
+ * @param prog receives compiled script
+ * @param cb_out call-back to stdout stream, for reporting errors - required, as for uP_RunScript()
+ * @return int UP_STATUS_OK if compiled, otherwise UP_STATUS_UNKNOWN for an unknown command, UP_STATUS_OVERFLOW if the script
+ * exceeds a MAX_PROGRAM_ limit, or UP_STATUS_PARAMS for any other error
+ */
+int uP_CompileScript(const char * script, int len, uP_Program * prog, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  int status = compileScript(script, len, prog);
+  endCall();
+  return status;
+}
+
+/**
+ * @brief Run a script compiled by uP_CompileScript(). Output of each command goes to the given call-back, as for interactive input.
+ * 
+ * @param prog compiled script - variables are reset to zero each run
+ * @param cb_out call-back to stdout stream, for command output - required, as for uP_RunScript()
+ * @return int status of the last command run
+ */
+int uP_RunProgram(uP_Program * prog, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  int status = runProgram(prog);
+  endCall();
+  return status;
+}
+#endif
+
+#if UP_SCRIPT_FILES
+/**
+ * @brief Run a script of commands from a file, as uP_RunScript() does, reading one line at a time.
+ * 
+ * @param path file to run
+ * @param stopOnError true to stop at the first command that fails, reporting the line number
+ * @param cb_out call-back to stdout stream, for command output - required, since output is not buffered for return as it is
+ * by uP_ProcessChar(), so is lost if NULL
+ * @return int status of the first command to fail, UP_STATUS_FAILED if the file can't be opened, or UP_STATUS_OK
+ */
+int uP_RunScriptFile(const char * path, bool stopOnError, int (*cb_out)(int c))
+{
+  beginCall(cb_out);
+  int status = runScriptFile(path, stopOnError);
+  endCall();
+  return status;
+}
+#endif
+
+/**
+ * @brief Common set-up for each call that processes input: take the lock (see UP_LOCK), track call-back, and initialize anything
+ * not already initialized. Each call must be matched by endCall().
+ * 
+ * @param cb_out call-back to stdout stream, or NULL to buffer output for return
+ */
+static void beginCall(int (*cb_out)(int c))
+{
+  UP_LOCK();
+
+  // Copy pointer to character output call-back as file global, for use by other functions herein.
+  g_cb_out = cb_out;
+  g_s->cb_out = cb_out;
+
+  // If uP_RegisterHandler() was never called to register any user commands, then initialize it now so that at least "help" is handled.
+  // Maybe make it a special help command, to provide help on how to register commands ?
+  if (!g_s->reg->builtIns)
+    registerBuiltIns();
+
+#if UP_FEATURE_KEYMAP
+  if (!g_keymapSet)
+    uP_setKeymap(UP_KEYMAP_DEFAULT);
+#endif
+}
+
+/**
+ * @brief Register the built-in handlers, "help" first.
+ * 
+ */
+static void registerBuiltIns(void)
+{
+  // Recursively calls uP_RegisterHandler(). Flag initialized _first_ to avoid infinite recursion!
+  g_s->reg->builtIns = true;
+#if UP_FEATURE_HELP
+  uP_RegisterHandler("help", handle_help, "this help message", NULL);
+#endif
+#if UP_FEATURE_DUMP
+  uP_RegisterHandler("dump", handle_dump, "hex dump of memory: dump <addr> <len>", NULL);
+#endif
+#if UP_COMPILED_SCRIPTS
+  uP_RegisterHandler("run", handle_run, "compile and run a script: run \"<statement>; ...\" (repeat <n>, if ok|fail, else, end, let <var> <n> [+|- <n>])", NULL);
+#endif
+#if UP_VARIABLES
+  uP_RegisterHandler("set", handle_set, "set a variable of this session, given to commands as $<name>: set [<name> [<value>]]", NULL);
+  uP_RegisterHandler("unset", handle_unset, "delete variables: unset <name> ...", NULL);
+#endif
+#if UP_WATCH
+  uP_RegisterHandler("watch", handle_watch, "run a command every so often: watch [-d] [-n <ms>] <command> (2000ms by default, -d to send "
+    "only changes), or watch alone to list", NULL);
+  uP_RegisterHandler("unwatch", handle_unwatch, "stop watches: unwatch [<watch> ...] (all of this session by default)", NULL);
+#endif
+#if UP_ALIASES
+  uP_RegisterHandler("alias", handle_alias, "define a command as a list of others: alias [<name> [\"<command>; ...\"]], or alias -d <name> - "
+    "parameters follow the last command, or replace $1..$9", NULL);
+#endif
+#if UP_SCRIPT_FILES
+  uP_RegisterHandler("source", handle_source, "run commands from a file: source [-e] <file> (-e to stop on first error)", NULL);
+#endif
+}
+
+/**
+ * @brief Common wrap-up for each call that processes input, giving up the lock taken by beginCall().
+ * 
+ * @return char* any pending output characters, otherwise an empty string
+ */
+static char * endCall(void)
+{
+  static char empty[] = "";
+  char * out = empty;
+  if (g_s->outCharIdx > 0)
+  {
+    g_s->outCharsBuf[g_s->outCharIdx] = '\0';   // make sure string is null-terminated
+    g_s->outCharIdx = 0;                     // reset buffer index
+    out = g_s->outCharsBuf;
+  }
+
+  UP_UNLOCK();
+  return out;
+}
+
+/**
+ * @brief Process one character of input: line editing, escape sequences, history recall, and processing of completed lines.
+ * Sets g_charReturn for uP_ProcessChar() to return the line recalled, or nothing while input is taken in without editing.
+ * 
+ * @param c next character from the input stream
+ */
+static void processChar(const char c)
+{
+  int extChar = 0;
+
+  g_charReturn = NULL;
+
+#if UP_IDLE_TIMEOUTS
+  // Note the input, for the idle timeout to find when it falls due.
+  g_s->activeTick = g_wheelTick;
+#endif
+
+#if UP_FEATURE_MACHINE
+  // In machine mode, everything is a frame.
+  // A frame start at the beginning of an empty line switches to machine mode, no escape sequence needed.
+  if (g_s->machineMode || ((c == UP_FRAME_SOF) && (g_s->lineIdx == 0) && !g_s->pasting))
+  {
+    g_s->machineMode = true;
+    machineChar(c);
+    return;
+  }
+#endif
+
+#if UP_FEATURE_PASTE
+  // Ask the terminal to start (or stop) bracketing pasted text, if changed since last call.
+  if (g_s->pasteModePending)
+  {
+    g_s->pasteModePending = false;
+    uP_printf("%s", g_s->pasteEnabled ? "\x1B[?2004h" : "\x1B[?2004l");
+  }
+#endif
+
+  // Handle ctl-C.
+  if (c == '\03')
+  {
+#if UP_FEATURE_STREAM
+    // Let any streaming handler know its data was cut short.
+    if (g_s->streamIdx >= 0)
+    {
+      g_s->reg->cmd[g_s->streamIdx].stream(g_s->reg->cmd[g_s->streamIdx].cmd, NULL, 0, true);
+      g_s->streamIdx = -1;
+    }
+#endif
+
+    // Output "^C", advance line and show prompt.
+#if UP_FEATURE_HINTS
+    eraseGhostHint();
+#endif
+    uP_printf("^C%s%s", g_s->outLineEnd, g_s->prompt);
+
+    // Reset line buffer and edit statics.
+    g_s->lineBuf[0] = '\0';
+    g_s->lineIdx = 0;
+    g_s->editIdx = -1;
+    g_s->lastChar = -1;
+    g_s->deferIdx = -1;
+  }
+
+  // Catch escape sequences in incoming character stream.
+  // An escape that turns out not to start a sequence is the escape key, which comes before the character, handled as usual.
+  int esc = processEscapes(c);
+  bool loneEsc = (esc == ESC_LONE);
+  if (loneEsc)
+    esc = ESC_NO_ACTION;
+
+#if UP_FEATURE_STREAM
+  // Once streaming, the rest of the line goes to the streaming handler as is, apart from escape sequences.
+  // Paste markers are still tracked, since a paste may well be what's streaming.
+  if (g_s->streamIdx >= 0)
+  {
+    if ((esc == ESC_PASTE_START) || (esc == ESC_PASTE_END))
+      g_s->pasting = (esc == ESC_PASTE_START);
+    else if (esc == ESC_NO_ACTION)
+      streamChar(c);
+    return;
+  }
+#endif
+
+  if (loneEsc && !g_s->pasting)
+  {
+#if UP_FEATURE_PASTE
+    settleLine();
+#endif
+    editLine(UP_KEY_ESC);
+  }
+
+#if UP_FEATURE_STREAM
+  // A space following a streaming command starts streaming.
+  if ((esc == ESC_NO_ACTION) && (c == ' ') && (g_s->reg->numStreamCmds > 0) && startStream())
+    return;
+#endif
+
+#if UP_FEATURE_PASTE
+  // While pasting or receiving a burst, printable characters go straight into the line buffer without echo or cursor
+  // bookkeeping, which is deferred until the end of each line (or the end of the paste or burst). Line-ends pass on to the
+  // line editor below. Within a bracketed paste, anything else (escape sequences, other control characters) is ignored,
+  // while during a burst anything else is edited as usual, since keys such as arrows arrive as bursts of their own.
+  if ((g_s->pasting || g_s->bursting) && (esc == ESC_NO_ACTION))
+  {
+    if (((c >= ' ') && (c <= '~')) || (g_s->pasting && (c == '\t')))
+    {
+      deferChar((c == '\t') ? ' ' : c);
+      g_charReturn = g_noReturn;
+      return;
+    }
+    if (g_s->pasting && (c != '\r') && (c != '\n'))
+    {
+      g_charReturn = g_noReturn;
+      return;
+    }
+  }
+  else if (g_s->pasting && (esc > ESC_NO_ACTION) && (esc != ESC_PASTE_END))
+  {
+    g_charReturn = g_noReturn;
+    return;
+  }
+#endif
+
+  switch(esc)
+  {
+    case ESC_PROCESSING:    // still processing an escape sequence - nothing more to do
+      g_charReturn = g_noReturn;
+      return;
+#if UP_FEATURE_PASTE
+    case ESC_PASTE_START:   // terminal is about to send pasted text
+      g_s->pasting = true;
+      g_charReturn = g_noReturn;
+      return;
+    case ESC_PASTE_END:     // paste complete - show whatever was left on the line, leaving it for further editing
+      g_s->pasting = false;
+      extChar = ESC_UNHANDLED;
+      break;
+#endif
+    case ESC_NO_ACTION:     // no escape sequence (and not working on one) - just process the character given
+      extChar = (unsigned char)c;   // bytes from 0x80 fall below the UP_KEY_ codes, bound to nothing
+      break;
+    default:    // escape sequence matched, returning a key (UP_KEY_) - let line editor call handle it below
+      extChar = esc;
+      break;
+  }
+
+#if UP_FEATURE_PASTE
+  // Echo any characters deferred during a paste or burst before editing further.
+  settleLine();
+#endif
+
+  // Edit line
+  if (editLine(extChar))
+  {
+    /** Line-end received, command has been entered. **/
+
+    // Terminate buffer and reset the line index.
+    g_s->lineBuf[g_s->lineIdx] = '\0';  // make sure we're terminated
+    g_s->lineIdx = 0;          // reset for next command
+
+    // Reset the recall index.
+    g_s->recallIdx = -1;
+
+    if (!isEmptyLine(g_s->lineBuf))
+    {
+      // Put a line between what was just entered and whatever output the response will be, unless CR only entered.
+      uP_printf("%s", g_s->outLineEnd);
+
+      // Track history, including unhandled commands, before the line is split into command and parameters.
+      addHistory(g_s->lineBuf);
+
+      // Parse and process string received.
+#if UP_FEATURE_JSON
+      if (g_s->responseMode == UP_RESPONSE_JSON)
+        processLineJson(g_s->lineBuf);
+      else
+#endif
+        processLine(g_s->lineBuf);
+    }
+
+    // Prompt
+    uP_printf("%s%s", g_s->outLineEnd, g_s->prompt);
+  }
+}
+
+/**
+ * @brief Set the preferred line-end characters for stdout. Default is a single line-feed.
+ * May be "\r", "\n" or "\r\n", or any string of up to two characters.
+ * 
+ * @param c preferred line-end characters, max two characters
+ */
+void uP_setOutLineEnd(const char * str)
+{
+  memset(g_s->outLineEnd, 0, sizeof(g_s->outLineEnd));      // pre-clear string
+  strncpy(g_s->outLineEnd, str, sizeof(g_s->outLineEnd)-1); // copy up to two characters for line-end
+}
+
+#if UP_FEATURE_PASTE
+/**
+ * @brief Enable or disable bracketed paste mode in the terminal. Once enabled, text pasted into the terminal arrives
+ * between ESC[200~ and ESC[201~ markers, and is ingested in bulk: echoed once per line rather than once per character,
+ * with each embedded line-end completing and processing its line in turn.
+ * The request is sent to the terminal with the output of the next call to uP_ProcessChar().
+ * Paste markers are recognized regardless, in case the terminal was placed in bracketed paste mode some other way.
+ * 
+ * @param enable true to ask the terminal to bracket pasted text, false to ask it to stop
+ */
+void uP_setBracketedPaste(bool enable)
+{
+  g_s->pasteEnabled = enable;
+  g_s->pasteModePending = true;
+}
+#endif
+
+/**
+ * @brief Set the width of the terminal, for listing candidate commands in columns on a second TAB.
+ * 
+ * @param cols terminal columns, 80 by default (TERMINAL_WIDTH)
+ */
+void uP_setTerminalWidth(int cols)
+{
+  if (cols > 0)
+    g_s->termWidth = cols;
+}
+
+/**
+ * @brief Set a prompt string to feed back to the outgoing stream.
+ * 
+ * @param str prompt string, as "> "
+ */
+void uP_setPrompt(const char * str)
+{
+  memset(g_s->prompt, 0, g_s->promptSize);
+  strncpy(g_s->prompt, str, g_s->promptSize-1);
+}
+
+/**
+ * @brief Check number of parameters, based on given criteria, show error and return false if bad.
+ * 
+ * @param numGivenParams the number of parameters given
+ * @param numExpectedParams the number of parameters expected
+ * @return true if parameters are good, false if bad
+ */
+bool uP_confirmParameters(int numGivenParams, int numExpectedParams)
+{
+  if (numGivenParams < numExpectedParams)
+  {
+    uP_printf("*** You only gave me %d parameter%s, I need at least %d ***\n", numGivenParams, (numGivenParams>1)?"s":"", numExpectedParams);
+    g_status = UP_STATUS_PARAMS;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Report the status of the command being handled, when other than success. Handlers need not call this on success,
+ * since status is reset before each handler is called. Reported in machine-mode response frames.
+ * 
+ * @param status status code, UP_STATUS_OK or one of the UP_STATUS_ error codes (or any application code beyond them)
+ */
+void uP_setStatus(int status)
+{
+  g_status = status;
+}
+
+#if UP_FEATURE_MACHINE
+/**
+ * @brief Switch between interactive mode (line editing, for people) and machine mode (framed requests and responses, for scripts).
+ * Sending a frame start (UP_FRAME_SOF) at the start of a line also switches to machine mode, and a request with no payload
+ * (the sentinel) switches back.
+ * 
+ * In machine mode, each request frame is:
+ *   UP_FRAME_SOF, length (2 bytes, LSB first), command line (length bytes, no line-end), CRC (2 bytes, LSB first)
+ * and each command is answered with a response frame:
+ *   UP_FRAME_SOF, length (2 bytes, LSB first), status (1 byte, UP_STATUS_), command output (length bytes), CRC (2 bytes, LSB first)
+ * The CRC is CRC-16/CCITT-FALSE (polynomial 0x1021, initial 0xFFFF), calculated over everything between SOF and CRC.
+ * A request failing its CRC is answered with UP_STATUS_BAD_FRAME. Output beyond MAX_RESPONSE_CHARS is dropped, and flagged
+ * with UP_STATUS_OVERFLOW unless the command reported some other failure.
+ * 
+ * @param enable true to switch to machine mode, false to switch back to interactive mode
+ */
+void uP_setMachineMode(bool enable)
+{
+  g_s->machineMode = enable;
+  g_s->frameState = FRAME_SOF;
+}
+#endif
+
+#if UP_FEATURE_JSON
+/**
+ * @brief Set how interactive input is echoed and answered.
+ * In UP_RESPONSE_JSON mode, nothing is echoed and no prompt is shown. Each line may start with a correlation ID as "@<id>",
+ * and is answered with a single line holding a JSON object, once the command completes, for example:
+ *   @17 read all
+ *   {"id":"17","status":0,"out":"..."}
+ * where status is UP_STATUS_OK or one of the UP_STATUS_ error codes, and out is all output of the command. The id is null
+ * if none was given. Since each response is self-delimiting and tagged, a host may send many commands without waiting.
+ * Output beyond MAX_RESPONSE_CHARS is dropped and flagged with UP_STATUS_OVERFLOW, as for machine mode.
+ * 
+ * @param mode UP_RESPONSE_TEXT (default) or UP_RESPONSE_JSON
+ */
+void uP_setResponseMode(int mode)
+{
+  g_s->responseMode = mode;
+}
+#endif
+
+#if UP_FEATURE_KEYMAP
+/**
+ * @brief Set the key bindings of line editing to a preset. Key bindings are shared by all sessions, though each session
+ * keeps its own vi mode. Individual keys may then be rebound with uP_bindKey().
+ * 
+ * @param preset UP_KEYMAP_DEFAULT, UP_KEYMAP_EMACS or UP_KEYMAP_VI
+ */
+void uP_setKeymap(int preset)
+{
+  typedef struct
+  {
+    short key;
+    unsigned char action;
+  } Binding;
+  static const Binding kDefaultKeys[] =
+  {
+    { '\r', UP_ACT_ENTER },                 { '\n', UP_ACT_ENTER },
+    { 0x08, UP_ACT_BACKSPACE },             { 0x7F, UP_ACT_BACKSPACE },
+    { '\t', UP_ACT_COMPLETE },              { UP_KEY_DEL, UP_ACT_DELETE },
+    { UP_KEY_LEFT, UP_ACT_LEFT },           { UP_KEY_RIGHT, UP_ACT_RIGHT },
+    { UP_KEY_HOME, UP_ACT_HOME },           { UP_KEY_END, UP_ACT_END },
+    { UP_KEY_CTRL_LEFT, UP_ACT_WORD_LEFT }, { UP_KEY_CTRL_RIGHT, UP_ACT_WORD_RIGHT },
+    { UP_KEY_UP, UP_ACT_HISTORY_PREV },     { UP_KEY_DOWN, UP_ACT_HISTORY_NEXT },
+  };
+  static const Binding kEmacsKeys[] =
+  {
+    { UP_KEY_CTRL('A'), UP_ACT_HOME },      { UP_KEY_CTRL('E'), UP_ACT_END },
+    { UP_KEY_CTRL('B'), UP_ACT_LEFT },      { UP_KEY_CTRL('F'), UP_ACT_RIGHT },
+    { UP_KEY_CTRL('D'), UP_ACT_DELETE },    { UP_KEY_CTRL('K'), UP_ACT_KILL_END },
+    { UP_KEY_CTRL('U'), UP_ACT_KILL_START },{ UP_KEY_CTRL('W'), UP_ACT_KILL_WORD },
+    { UP_KEY_CTRL('P'), UP_ACT_HISTORY_PREV },  { UP_KEY_CTRL('N'), UP_ACT_HISTORY_NEXT },
+  };
+  static const Binding kViKeys[] =
+  {
+    { UP_KEY_ESC, UP_ACT_VI_COMMAND },
+    { UP_KEY_CTRL('U'), UP_ACT_KILL_START },{ UP_KEY_CTRL('W'), UP_ACT_KILL_WORD },
+  };
+  const Binding * extra = NULL;
+  int numExtra = 0;
+  int i;
+
+  for (i=0;i<(int)sizeof(g_keymap);i++)
+    g_keymap[i] = ((i >= ' ') && (i <= '~')) ? UP_ACT_INSERT : UP_ACT_NONE;
+  for (i=0;i<(int)NUM_ELEMENTS(kDefaultKeys);i++)
+    g_keymap[kDefaultKeys[i].key] = kDefaultKeys[i].action;
+
+  if (preset == UP_KEYMAP_EMACS)
+  {
+    extra = kEmacsKeys;
+    numExtra = NUM_ELEMENTS(kEmacsKeys);
+  } else if (preset == UP_KEYMAP_VI)
+  {
+    extra = kViKeys;
+    numExtra = NUM_ELEMENTS(kViKeys);
+  }
+  for (i=0;i<numExtra;i++)
+    g_keymap[extra[i].key] = extra[i].action;
+
+  g_keymapSet = true;
+}
+
+/**
+ * @brief Bind a key to a line editing action, in place of its preset binding.
+ * 
+ * @param key character (as UP_KEY_CTRL('K')), or UP_KEY_ key
+ * @param action UP_ACT_ action, or UP_ACT_NONE to ignore the key
+ * @return true if bound, false if key or action is out of range
+ */
+bool uP_bindKey(int key, int action)
+{
+  if ((key < 0) || (key >= (int)sizeof(g_keymap)) || (action < UP_ACT_NONE) || (action > UP_ACT_VI_COMMAND))
+    return false;
+  if (!g_keymapSet)
+    uP_setKeymap(UP_KEYMAP_DEFAULT);
+  g_keymap[key] = action;
+  return true;
+}
+#else
+/**
+ * @brief Find the editing action of a key, bound as by UP_KEYMAP_DEFAULT, without the key bindings table.
+ * 
+ * @param key character, or UP_KEY_ key
+ * @return int UP_ACT_ action, UP_ACT_NONE if none
+ */
+static int keyAction(int key)
+{
+  if ((key >= ' ') && (key <= '~'))
+    return UP_ACT_INSERT;
+  switch (key)
+  {
+    case '\r':
+    case '\n':
+      return UP_ACT_ENTER;
+    case 0x08:
+    case 0x7F:
+      return UP_ACT_BACKSPACE;
+    case '\t':
+      return UP_ACT_COMPLETE;
+    case UP_KEY_DEL:
+      return UP_ACT_DELETE;
+    case UP_KEY_LEFT:
+      return UP_ACT_LEFT;
+    case UP_KEY_RIGHT:
+      return UP_ACT_RIGHT;
+    case UP_KEY_HOME:
+      return UP_ACT_HOME;
+    case UP_KEY_END:
+      return UP_ACT_END;
+    case UP_KEY_CTRL_LEFT:
+      return UP_ACT_WORD_LEFT;
+    case UP_KEY_CTRL_RIGHT:
+      return UP_ACT_WORD_RIGHT;
+    case UP_KEY_UP:
+      return UP_ACT_HISTORY_PREV;
+    case UP_KEY_DOWN:
+      return UP_ACT_HISTORY_NEXT;
+  }
+  return UP_ACT_NONE;
+}
+#endif
+
+/**
+ * @brief Edit current line, by the action bound to each key (see uP_setKeymap()): insert printable characters, and move,
+ * delete, complete, recall history or end the line. Automatically handles either c/r or l/f single-character line-ends OR
+ * c/r-l/f (or l/f-c/r) two-character line-ends.
+ * 
+ * @param key character, or key recognized from an escape sequence (UP_KEY_) - anything else is ignored
+ * @return true if line has just been completed by line-end character
+ */
+static bool editLine(int key)
+{
+  bool rcode = false;
+  int action;
+  int i;
+
+  // If first edit of line, set edit index to end of line.
+  // If new line, make sure line buffer is empty.
+  if (g_s->editIdx < 0)
+  {
+    g_s->editIdx = g_s->lineIdx;
+    if (g_s->lineIdx == 0)
+      g_s->lineBuf[0] = '\0';
+  }
+
+#if UP_FEATURE_KEYMAP
+  if ((key < 0) || (key >= (int)sizeof(g_keymap)))
+    return false;
+  action = g_keymap[key];
+#else
+  action = keyAction(key);
+#endif
+#if UP_FEATURE_HINTS
+  eraseGhostHint();
+#endif
+
+#if UP_FEATURE_KEYMAP
+  // In vi command mode, characters are commands rather than text.
+  if (g_s->viCommand && (action == UP_ACT_INSERT))
+    action = viCommand(key);
+#endif
+
+  // Only a TAB straight after an ambiguous one lists the candidates.
+  if (action != UP_ACT_COMPLETE)
+    g_s->tabAmbiguous = false;
+
+  // Printable characters are by far the most common key, and are usually appended, so handle them first, without the
+  // string shuffle of insertCharAtIndex() or any redraw.
+  if (action == UP_ACT_INSERT)
+  {
+    if ((g_s->editIdx == g_s->lineIdx) && (g_s->lineIdx < g_s->lineSize-1))
+    {
+      g_s->lineBuf[g_s->lineIdx++] = key;
+      g_s->lineBuf[g_s->lineIdx] = '\0';
+      g_s->editIdx++;
+      outChar(key);
+#if UP_FEATURE_HINTS
+      if (key == ' ')
+        showGhostHint();
+#endif
+    } else if (insertCharAtIndex(g_s->lineBuf, g_s->editIdx, key, g_s->lineSize))
+    {
+      // Adjust output to terminal.
+      outChar(key);
+      g_s->editIdx++;
+      g_s->lineIdx++;  // adjust to indicate longer line
+      outStr(&g_s->lineBuf[g_s->editIdx], g_s->lineIdx - g_s->editIdx);
+      for (i=g_s->editIdx;i<g_s->lineIdx;i++)
+        outChar('\x08');  // move output cursor from end of line back to inserted location
+    }
+    g_s->lastChar = key;
+    return false;
+  }
+
+  switch (action)
+  {
+    case UP_ACT_ENTER:
+      // c/r indicates line complete UNLESS it immediately follows a l/f, and l/f UNLESS it immediately follows a c/r, in which
+      // case we assume that we're being sent two-character line-ends (c/r-l/f or l/f-c/r).
+      if (key == '\r')
+        rcode = g_s->lastChar != '\n';
+      else if (key == '\n')
+        rcode = g_s->lastChar != '\r';
+      else
+        rcode = true;
+      break;
+    case UP_ACT_BACKSPACE:
+      if (g_s->editIdx > 0)
+        deleteChars(g_s->editIdx - 1, 1);
+      break;
+    case UP_ACT_DELETE:
+      if (g_s->editIdx < g_s->lineIdx)
+        deleteChars(g_s->editIdx, 1);
+      break;
+    case UP_ACT_LEFT:
+      if (g_s->editIdx > 0)
+        moveCursor(g_s->editIdx - 1);
+      break;
+    case UP_ACT_RIGHT:
+      if (g_s->editIdx < g_s->lineIdx)
+        moveCursor(g_s->editIdx + 1);
+      break;
+    case UP_ACT_HOME:
+      moveCursor(0);
+      break;
+    case UP_ACT_END:
+      moveCursor(g_s->lineIdx);
+      break;
+    case UP_ACT_WORD_LEFT:
+      moveCursor(wordStart(g_s->editIdx));
+      break;
+    case UP_ACT_WORD_RIGHT:
+      // Past the rest of this word (or the spaces before the next), then past the next word.
+      i = g_s->editIdx;
+      while ((i < g_s->lineIdx) && (g_s->lineBuf[i] == ' '))
+        i++;
+      while ((i < g_s->lineIdx) && (g_s->lineBuf[i] != ' '))
+        i++;
+      moveCursor(i);
+      break;
+#if UP_FEATURE_KEYMAP
+    case UP_ACT_KILL_END:
+      deleteChars(g_s->editIdx, g_s->lineIdx - g_s->editIdx);
+      break;
+    case UP_ACT_KILL_START:
+      deleteChars(0, g_s->editIdx);
+      break;
+    case UP_ACT_KILL_WORD:
+      i = wordStart(g_s->editIdx);
+      deleteChars(i, g_s->editIdx - i);
+      break;
+#endif
+    case UP_ACT_COMPLETE:
+#if UP_FEATURE_TAB
+      if (g_s->editIdx == g_s->lineIdx)
+        completeWord();
+#endif
+      break;
+    case UP_ACT_HISTORY_PREV:
+    case UP_ACT_HISTORY_NEXT:
+      g_charReturn = g_noReturn;    // unless a line is recalled
+#if UP_FEATURE_HISTORY
+      recallHistory(action == UP_ACT_HISTORY_PREV);
+#endif
+      break;
+#if UP_FEATURE_KEYMAP
+    case UP_ACT_VI_COMMAND:
+      g_s->viCommand = true;
+      break;
+#endif
+    default:    // ignore anything else
+      return false;
+  }
+
+  // Track latest character, so we can differentiate c/r-l/f line ends from an extra blank line.
+  g_s->lastChar = key;
+
+  // Reset edit index (and vi mode) on end of line.
+  if (rcode)
+  {
+    g_s->editIdx = -1;
+    g_s->lastChar = -1;
+    g_s->viCommand = false;
+  }
+
+  // Return whether line has been ended.
+  return rcode;
+}
+
+#if UP_FEATURE_KEYMAP
+/**
+ * @brief Translate a character typed in vi command mode to an editing action, leaving command mode for those that insert.
+ * 
+ * @param key character
+ * @return int UP_ACT_ action, UP_ACT_NONE if none
+ */
+static int viCommand(int key)
+{
+  static const struct
+  {
+    char key;
+    unsigned char action;
+    bool insert;    // back to insert mode, after the action
+  } kViCommands[] =
+  {
+    { 'h', UP_ACT_LEFT, false },          { 'l', UP_ACT_RIGHT, false },
+    { '0', UP_ACT_HOME, false },          { '$', UP_ACT_END, false },
+    { 'b', UP_ACT_WORD_LEFT, false },     { 'w', UP_ACT_WORD_RIGHT, false },
+    { 'x', UP_ACT_DELETE, false },        { 'D', UP_ACT_KILL_END, false },
+    { 'k', UP_ACT_HISTORY_PREV, false },  { 'j', UP_ACT_HISTORY_NEXT, false },
+    { 'i', UP_ACT_NONE, true },           { 'a', UP_ACT_RIGHT, true },
+    { 'I', UP_ACT_HOME, true },           { 'A', UP_ACT_END, true },
+  };
+  int i;
+
+  for (i=0;i<(int)NUM_ELEMENTS(kViCommands);i++)
+  {
+    if (kViCommands[i].key == key)
+    {
+      if (kViCommands[i].insert)
+        g_s->viCommand = false;
+      return kViCommands[i].action;
+    }
+  }
+  return UP_ACT_NONE;
+}
+#endif
+
+/**
+ * @brief Move the edit index, and the terminal's cursor with it, by backspacing or by rewriting characters.
+ * 
+ * @param idx new edit index, from 0 to the end of the line
+ */
+static void moveCursor(int idx)
+{
+  while (g_s->editIdx > idx)
+  {
+    outChar('\x08');
+    g_s->editIdx--;
+  }
+  while (g_s->editIdx < idx)
+    outChar(g_s->lineBuf[g_s->editIdx++]);
+}
+
+/**
+ * @brief Delete characters from the line, and from the terminal, leaving the edit index (and cursor) where they were.
+ * 
+ * @param from index of first character to delete, no later than the edit index
+ * @param n number of characters to delete
+ */
+static void deleteChars(int from, int n)
+{
+  int i;
+
+  if (n <= 0)
+    return;
+
+  // Back up to the first character deleted, then rewrite the rest of the line, and blank out what's left beyond it.
+  moveCursor(from);
+  memmove(&g_s->lineBuf[from], &g_s->lineBuf[from + n], g_s->lineIdx - (from + n) + 1);
+  g_s->lineIdx -= n;
+  outStr(&g_s->lineBuf[from], g_s->lineIdx - from);
+  for (i=0;i<n;i++)
+    outChar(' ');
+  for (i=from;i<g_s->lineIdx + n;i++)
+    outChar('\x08');  // move output cursor from end of line back to the edit index
+}
+
+/**
+ * @brief Find the start of the word before an index in the line, skipping any spaces first.
+ * 
+ * @param idx index to search back from
+ * @return int index of start of word
+ */
+static int wordStart(int idx)
+{
+  while ((idx > 0) && (g_s->lineBuf[idx-1] == ' '))
+    idx--;
+  while ((idx > 0) && (g_s->lineBuf[idx-1] != ' '))
+    idx--;
+  return idx;
+}
+
+#if UP_FEATURE_TAB || UP_FEATURE_HINTS
+/**
+ * @brief Find where the command being typed (the last in the line) and the word at the end of the line start, following the
+ * same quoting rules as tokenize().
+ * 
+ * @param cmdStart receives index of start of command, if any
+ * @param cmdLen receives length of command, 0 if none yet complete
+ * @param wordStart receives index of the word at the end of the line, or the end of the line if it ends with a separator
+ * @return int number of parameters complete before that word
+ */
+static int scanLine(int * cmdStart, int * cmdLen, int * wordStart)
+{
+  int numTok = 0;
+  int start = -1;     // start of token being scanned, -1 if between tokens
+  bool quoted = false;
+  int i;
+
+  *cmdStart = 0;
+  *cmdLen = 0;
+  for (i=0;i<g_s->lineIdx;i++)
+  {
+    char c = g_s->lineBuf[i];
+    if (quoted)
+    {
+      quoted = (c != '"');
+      continue;
+    }
+    if ((c == ' ') || (c == ',') || (c == ';'))
+    {
+      if ((start >= 0) && (numTok++ == 0))
+      {
+        *cmdStart = start;
+        *cmdLen = i - start;
+      }
+      start = -1;
+      if (c == ';')
+      {
+        numTok = 0;
+        *cmdLen = 0;
+      }
+    } else if (start < 0)
+    {
+      start = i;
+      quoted = (c == '"');
+    }
+  }
+
+  *wordStart = (start >= 0) ? start : g_s->lineIdx;
+  return (numTok > 0) ? numTok - 1 : -1;
+}
+
+#endif
+
+#if UP_FEATURE_TAB
+/**
+ * @brief Complete the word at the end of the line: a command, if the characters given so far uniquely identify a known command,
+ * or a parameter, from the values listed in the command's hints, as far as all values starting with the characters given agree.
+ * A placeholder hint (as "<x coord>") is shown as a ghost hint instead.
+ * 
+ */
+static void completeWord(void)
+{
+  int cmdStart;
+  int cmdLen;
+  int start;
+  int param = scanLine(&cmdStart, &cmdLen, &start);
+  const char * word = NULL;
+  int len = 0;
+
+  if (param < 0)
+  {
+    // Command - on a second TAB, list the candidates if the first matched more than one.
+    int idx = uniquePartialMatch(&g_s->lineBuf[start]);
+    if (idx < 0)
+    {
+      if (g_s->tabAmbiguous)
+        listCommands(&g_s->lineBuf[start], g_s->lineIdx - start);
+      g_s->tabAmbiguous = !g_s->tabAmbiguous;
+      return;
+    }
+    word = g_s->reg->cmd[idx].cmd;
+    len = strlen(word);
+  }
+#if UP_FEATURE_HINTS
+  else
+  {
+    // Parameter value.
+    int idx = hintCommand(cmdStart, cmdLen, param);
+    if (idx < 0)
+      return;
+    if (g_s->reg->cmd[idx].hints[param][0] == '<')
+    {
+      showGhostHint();
+      return;
+    }
+    len = matchHint(idx, param, &g_s->lineBuf[start], g_s->lineIdx - start, &word);
+  }
+#endif
+
+  // Append whatever the word has beyond the characters given.
+  int i;
+  for (i=g_s->lineIdx - start;(i < len) && (g_s->lineIdx < g_s->lineSize-1);i++)
+  {
+    g_s->lineBuf[g_s->lineIdx] = word[i];
+    outChar(g_s->lineBuf[g_s->lineIdx++]);
+  }
+  g_s->lineBuf[g_s->lineIdx] = '\0';
+  g_s->editIdx = g_s->lineIdx;
+}
+
+/**
+ * @brief List the commands starting with the characters given, in columns across the terminal, then show the prompt and
+ * line again. The column width (the longest command, plus two spaces) is worked out once per registry, and again only after
+ * more commands are registered, so each listing is written straight out, row by row, with no layout to do.
+ * 
+ * @param prefix characters given
+ * @param len number of characters given
+ */
+static void listCommands(const char * prefix, int len)
+{
+  Registry * r = g_s->reg;
+  int cols;
+  int col = 0;
+  int pad = 0;
+  int listed = 0;
+  int i;
+
+  if (r->listNumCmds != r->numCmds)
+  {
+    r->listWidth = 0;
+    for (i=0;i<r->numCmds;i++)
+    {
+      int width = strlen(r->cmd[i].cmd) + 2;
+      if (width > r->listWidth)
+        r->listWidth = width;
+    }
+    r->listNumCmds = r->numCmds;
+  }
+  cols = (r->listWidth > 0) ? g_s->termWidth / r->listWidth : 1;
+  if (cols < 1)
+    cols = 1;
+
+  // Commands in registration order, across then down, padding each but the last in a row out to the column width.
+  for (i=0;i<r->numCmds;i++)
+  {
+    const char * cmd = r->cmd[i].cmd;
+    if (strncmp(cmd, prefix, len) != 0)
+      continue;
+    if (col == 0)
+      outStr(g_s->outLineEnd, strlen(g_s->outLineEnd));
+    while (pad-- > 0)
+      outChar(' ');
+    int n = strlen(cmd);
+    outStr(cmd, n);
+    pad = r->listWidth - n;
+    listed++;
+    if (++col >= cols)
+    {
+      col = 0;
+      pad = 0;
+    }
+  }
+  if (listed > 0)
+  {
+    uP_printf("%s%s", g_s->outLineEnd, g_s->prompt);
+    outStr(g_s->lineBuf, g_s->lineIdx);
+  }
+}
+#endif
+
+#if UP_FEATURE_HINTS
+/**
+ * @brief Find the hint string for a parameter of the command being typed.
+ * 
+ * @param cmdStart index of command in line
+ * @param cmdLen length of command
+ * @param param parameter number, from 0
+ * @return int index of command, or -1 if unknown or no hint for the parameter
+ */
+static int hintCommand(int cmdStart, int cmdLen, int param)
+{
+  int idx;
+  int i;
+
+  if ((cmdLen == 0) || (param < 0))
+    return -1;
+  for (idx=0;idx<g_s->reg->numCmds;idx++)
+  {
+    const char * cmd = g_s->reg->cmd[idx].cmd;
+    if ((strncmp(cmd, &g_s->lineBuf[cmdStart], cmdLen) == 0) && (cmd[cmdLen] == '\0'))
+      break;
+  }
+  if ((idx >= g_s->reg->numCmds) || (g_s->reg->cmd[idx].hints == NULL))
+    return -1;
+  for (i=0;i<=param;i++)
+    if (g_s->reg->cmd[idx].hints[i] == NULL)
+      return -1;
+  return idx;
+}
+/**
+ * @brief Once a space is typed at the end of the line, show the placeholder hint (as "<x coord>") for the parameter that
+ * follows, if the command has one, as dim ghost text after the cursor. Costs just a few bytes to draw, since the cursor is
+ * moved back with a single escape sequence, and three to erase, see eraseGhostHint().
+ * 
+ */
+static void showGhostHint(void)
+{
+  int cmdStart;
+  int cmdLen;
+  int start;
+  int param = scanLine(&cmdStart, &cmdLen, &start);
+  int idx;
+
+  if ((start != g_s->lineIdx) || ((idx = hintCommand(cmdStart, cmdLen, param)) < 0))
+    return;
+  const char * hint = g_s->reg->cmd[idx].hints[param];
+  if (hint[0] != '<')
+    return;
+  uP_printf("\x1B[2m%s\x1B[0m\x1B[%dD", hint, (int)strlen(hint));
+  g_s->ghostShown = true;
+}
+
+/**
+ * @brief Erase any ghost hint shown after the cursor, before anything else is written to the line.
+ * 
+ */
+static void eraseGhostHint(void)
+{
+  if (g_s->ghostShown)
+  {
+    outStr("\x1B[K", 3);
+    g_s->ghostShown = false;
+  }
+}
+
+#endif
+
+#if UP_FEATURE_TAB && UP_FEATURE_HINTS
+/**
+ * @brief Find parameter values of a command starting with the characters given, using the prefix index of all values
+ * listed in hints, built once per registry (and rebuilt after more commands are registered).
+ * 
+ * @param cmdIdx index of command
+ * @param param parameter number, from 0
+ * @param prefix characters given
+ * @param len number of characters given
+ * @param word receives first value matching
+ * @return int length of the longest prefix shared by all values matching, 0 if none
+ */
+static int matchHint(int cmdIdx, int param, const char * prefix, int len, const char ** word)
+{
+  HintEntry key = { prefix, (unsigned char)len, (unsigned char)param, (short)cmdIdx };
+  int lo = 0;
+  int hi;
+
+  if ((g_hintReg != g_s->reg) || (g_hintNumCmds != g_s->reg->numCmds))
+    buildHintIndex();
+
+  // Binary search for the first value not before the prefix, which is the first to start with it, if any.
+  hi = g_numHints;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (compareHints(&g_hintIndex[mid], &key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  // Values starting with the prefix follow in order, so all share what the first and last share.
+  int last = lo;
+  while ((last < g_numHints) && (g_hintIndex[last].cmdIdx == cmdIdx) && (g_hintIndex[last].param == param) &&
+    (g_hintIndex[last].len >= len) && (memcmp(g_hintIndex[last].word, prefix, len) == 0))
+    last++;
+  if (last == lo)
+    return 0;
+
+  const HintEntry * first = &g_hintIndex[lo];
+  const HintEntry * final = &g_hintIndex[last-1];
+  int n = len;
+  while ((n < first->len) && (n < final->len) && (first->word[n] == final->word[n]))
+    n++;
+  *word = first->word;
+  return n;
+}
+
+/**
+ * @brief Build the prefix index of parameter values: every space-separated value of every hint string of every command,
+ * sorted by command, parameter and value. Values beyond MAX_HINT_WORDS are left out.
+ * 
+ */
+static void buildHintIndex(void)
+{
+  int idx;
+  int param;
+
+  g_numHints = 0;
+  for (idx=0;idx<g_s->reg->numCmds;idx++)
+  {
+    char const * const * hints = g_s->reg->cmd[idx].hints;
+    for (param=0;(hints != NULL) && (hints[param] != NULL);param++)
+    {
+      const char * p = hints[param];
+      if (p[0] == '<')
+        continue;   // placeholder, not values
+      while (*p != '\0')
+      {
+        while (*p == ' ')
+          p++;
+        int len = strcspn(p, " ");
+        if ((len > 0) && (len < 256) && (param < 256) && (g_numHints < MAX_HINT_WORDS))
+        {
+          HintEntry * e = &g_hintIndex[g_numHints++];
+          e->word = p;
+          e->len = len;
+          e->param = param;
+          e->cmdIdx = idx;
+        }
+        p += len;
+      }
+    }
+  }
+  qsort(g_hintIndex, g_numHints, sizeof(g_hintIndex[0]), compareHints);
+  g_hintReg = g_s->reg;
+  g_hintNumCmds = g_s->reg->numCmds;
+}
+
+/**
+ * @brief Order parameter values by command, parameter, then value, for qsort() and binary search.
+ * 
+ * @param a first HintEntry
+ * @param b second HintEntry
+ * @return int negative, zero or positive, as a is before, same as or after b
+ */
+static int compareHints(const void * a, const void * b)
+{
+  const HintEntry * x = (const HintEntry *)a;
+  const HintEntry * y = (const HintEntry *)b;
+
+  if (x->cmdIdx != y->cmdIdx)
+    return x->cmdIdx - y->cmdIdx;
+  if (x->param != y->param)
+    return x->param - y->param;
+  int n = (x->len < y->len) ? x->len : y->len;
+  int cmp = memcmp(x->word, y->word, n);
+  return (cmp != 0) ? cmp : (x->len - y->len);
+}
+#endif
+
+#if UP_FEATURE_HISTORY
+/**
+ * @brief Replace the line with the previous (or next) line of history.
+ * 
+ * @param back true for the previous line (up arrow), false for the next (down arrow)
+ */
+static void recallHistory(bool back)
+{
+  int i;
+
+  if (g_s->histDepth == 0)
+    return;
+
+  if (back)
+  {
+    // If first time since latest line, start with latest line,
+    // otherwise continue to rewind through circular history buffer.
+    if (g_s->recallIdx < 0)
+      i = (g_s->histDepth + g_s->histIdx - 1) % g_s->histDepth;
+    else
+      i = (g_s->histDepth + g_s->recallIdx - 1) % g_s->histDepth;
+
+    // Nothing to do if no prior history.
+    if (histLine(i)[0] == '\0')
+      return;
+  } else
+  {
+    // Nothing to wind forward to, if we haven't recalled any history yet,
+    // otherwise, wind forward, stopping just short of current history index.
+    if (g_s->recallIdx < 0)
+      return;
+    i = (g_s->recallIdx + 1) % g_s->histDepth;
+
+    // Nothing to do if we're up to current history index.
+    if (i == g_s->histIdx)
+      return;
+  }
+
+  // If line to recall, clear current line and recall it, with the cursor at its end.
+  g_s->recallIdx = i;
+  deleteChars(0, g_s->lineIdx);
+  strcpy(g_s->lineBuf, histLine(g_s->recallIdx));
+  g_s->lineIdx = strlen(g_s->lineBuf);
+  g_s->editIdx = g_s->lineIdx;
+  outStr(g_s->lineBuf, g_s->lineIdx);  // output back to stdout stream, via call-back
+  g_charReturn = g_s->lineBuf;  // return line recalled
+}
+#endif
+
+#if UP_FEATURE_SCRIPTS
+/**
+ * @brief Run each line of a script in turn, see uP_RunScript().
+ * 
+ * @param script text of script
+ * @param len number of characters in script
+ * @param stopOnError true to stop at the first command that fails
+ * @return int status of the first command to fail, or UP_STATUS_OK if none
+ */
+static int runScript(const char * script, int len, bool stopOnError)
+{
+  char line[MAX_TOTAL_COMMAND_CHARS+1];
+  int status = UP_STATUS_OK;
+  int lineNum = 0;
+  int i = 0;
+
+  // Guard against a script that runs itself, directly or otherwise.
+  if (g_scriptDepth >= MAX_SCRIPT_DEPTH)
+  {
+    uP_printf("*** Scripts nested too deep ***%s", g_s->outLineEnd);
+    return UP_STATUS_FAILED;
+  }
+  g_scriptDepth++;
+
+  while (i < len)
+  {
+    // Find end of line, copying what fits, since the line is modified as it is parsed.
+    int n = 0;
+    bool tooLong = false;
+    while ((i < len) && (script[i] != '\r') && (script[i] != '\n'))
+    {
+      if (n < (int)sizeof(line)-1)
+        line[n++] = script[i];
+      else
+        tooLong = true;
+      i++;
+    }
+    line[n] = '\0';
+
+    // Skip line-end, counting a c/r-l/f pair as one.
+    if ((i < len) && (script[i] == '\r'))
+      i++;
+    if ((i < len) && (script[i] == '\n'))
+      i++;
+    lineNum++;
+
+    int lineStatus;
+    if (tooLong)
+    {
+      uP_printf("*** Line %d too long ***%s", lineNum, g_s->outLineEnd);
+      lineStatus = UP_STATUS_OVERFLOW;
+    } else
+    {
+      lineStatus = runScriptLine(line, lineNum, stopOnError);
+    }
+
+    if ((lineStatus != UP_STATUS_OK) && (status == UP_STATUS_OK))
+      status = lineStatus;
+    if ((status != UP_STATUS_OK) && stopOnError)
+      break;
+  }
+
+  g_scriptDepth--;
+  return status;
+}
+#endif
+
+#if UP_SCRIPT_FILES
+/**
+ * @brief Run each line of a script file in turn, see uP_RunScriptFile().
+ * 
+ * @param path file to run
+ * @param stopOnError true to stop at the first command that fails
+ * @return int status of the first command to fail, UP_STATUS_FAILED if the file can't be opened, or UP_STATUS_OK
+ */
+static int runScriptFile(const char * path, bool stopOnError)
+{
+  char line[MAX_TOTAL_COMMAND_CHARS+2];   // room for line-end, to tell a full line from one too long
+  int status = UP_STATUS_OK;
+  int lineNum = 0;
+
+  // Guard against a script that runs itself, directly or otherwise.
+  if (g_scriptDepth >= MAX_SCRIPT_DEPTH)
+  {
+    uP_printf("*** Scripts nested too deep ***%s", g_s->outLineEnd);
+    return UP_STATUS_FAILED;
+  }
+
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL)
+  {
+    uP_printf("*** Can't open \"%s\" ***%s", path, g_s->outLineEnd);
+    return UP_STATUS_FAILED;
+  }
+  g_scriptDepth++;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    int lineStatus;
+    int n = strlen(line);
+    lineNum++;
+
+    if ((n > 0) && (line[n-1] != '\n') && !feof(fp))
+    {
+      // Line too long: report and skip the rest of it.
+      int c;
+      while (((c = fgetc(fp)) != EOF) && (c != '\n'))
+        ;
+      uP_printf("*** Line %d too long ***%s", lineNum, g_s->outLineEnd);
+      lineStatus = UP_STATUS_OVERFLOW;
+    } else
+    {
+      while ((n > 0) && ((line[n-1] == '\n') || (line[n-1] == '\r')))
+        line[--n] = '\0';
+      lineStatus = runScriptLine(line, lineNum, stopOnError);
+    }
+
+    if ((lineStatus != UP_STATUS_OK) && (status == UP_STATUS_OK))
+      status = lineStatus;
+    if ((status != UP_STATUS_OK) && stopOnError)
+      break;
+  }
+
+  fclose(fp);
+  g_scriptDepth--;
+  return status;
+}
+#endif
+
+#if UP_FEATURE_SCRIPTS || UP_SCRIPT_FILES
+/**
+ * @brief Run one line of a script, skipping blank lines and comments.
+ * 
+ * @param line line, without line-end - modified when parsed
+ * @param lineNum line number, for reporting an error
+ * @param stopOnError true if the script will stop if this line fails, to report it
+ * @return int status of line
+ */
+static int runScriptLine(char * line, int lineNum, bool stopOnError)
+{
+  // Skip leading spaces, to find blank lines and comments.
+  while (*line == ' ')
+    line++;
+  if ((*line == '\0') || (*line == '#'))
+    return UP_STATUS_OK;
+
+  processLine(line);
+
+  if ((g_status != UP_STATUS_OK) && stopOnError)
+    uP_printf("*** Stopped at line %d ***%s", lineNum, g_s->outLineEnd);
+  return g_status;
+}
+#endif
+
+#if UP_COMPILED_SCRIPTS
+/**
+ * @brief Compile a script, see uP_CompileScript().
+ * Each line is copied to the program's text, then split in place, so that parameters can point to it. Text of lines with
+ * no commands (only keywords or comments) is reclaimed for the next line.
+ * 
+ * @param script text of script
+ * @param len number of characters in script
+ * @param prog receives compiled script
+ * @return int UP_STATUS_OK, or error status
+ */
+static int compileScript(const char * script, int len, uP_Program * prog)
+{
+  short block[MAX_PROGRAM_DEPTH];   // statement opening each block not yet ended, innermost last
+  int depth = 0;
+  int lineNum = 0;
+  int i = 0;
+
+  prog->numOps = 0;
+  prog->numParams = 0;
+  prog->textLen = 0;
+  prog->numVars = 0;
+
+  while (i < len)
+  {
+    // Copy line to program text.
+    int start = prog->textLen;
+    int n = 0;
+    bool tooLong = false;
+    while ((i < len) && (script[i] != '\r') && (script[i] != '\n'))
+    {
+      if (start + n < (int)sizeof(prog->text)-1)
+        prog->text[start + n++] = script[i];
+      else
+        tooLong = true;
+      i++;
+    }
+    prog->text[start + n] = '\0';
+    if ((i < len) && (script[i] == '\r'))
+      i++;
+    if ((i < len) && (script[i] == '\n'))
+      i++;
+    lineNum++;
+
+    int status = UP_STATUS_OK;
+    int numOps = prog->numOps;
+    if (tooLong)
+    {
+      uP_printf("*** Line %d: script too long ***%s", lineNum, g_s->outLineEnd);
+      status = UP_STATUS_OVERFLOW;
+    }
+
+    // Compile each statement of the line.
+    char * line = &prog->text[start];
+    while ((line != NULL) && (status == UP_STATUS_OK))
+    {
+      char const * tok[MAX_PARAMETERS+1];
+      int numTok;
+      line = tokenize(line, tok, NUM_ELEMENTS(tok), &numTok, false);
+      if (numTok == 0)
+        continue;
+      if (tok[0][0] == '#')
+        break;    // comment to end of line
+      status = compileStatement(prog, tok, numTok, block, &depth);
+      if ((status != UP_STATUS_OK) && (unknownVariable(prog, tok, numTok) != NULL))
+        uP_printf("*** Line %d: unknown variable %s ***%s", lineNum, unknownVariable(prog, tok, numTok), g_s->outLineEnd);
+      else if (status != UP_STATUS_OK)
+        uP_printf("*** Line %d: can't compile \"%s\" ***%s", lineNum, tok[0], g_s->outLineEnd);
+    }
+    if (status != UP_STATUS_OK)
+    {
+      prog->numOps = 0;   // leave nothing runnable
+      return status;
+    }
+
+    // Keep the text of this line only if commands point to it.
+    bool keep = false;
+    int op;
+    for (op=numOps;op<prog->numOps;op++)
+      if ((prog->op[op].op == PROG_COMMAND) && (prog->op[op].numParams > 0))
+        keep = true;
+    if (keep)
+      prog->textLen = start + n + 1;
+  }
+
+  if (depth > 0)
+  {
+    uP_printf("*** Line %d: missing end ***%s", lineNum, g_s->outLineEnd);
+    prog->numOps = 0;
+    return UP_STATUS_PARAMS;
+  }
+  return UP_STATUS_OK;
+}
+
+/**
+ * @brief Compile one statement, already split into tokens.
+ * 
+ * @param prog program to add to
+ * @param tok statement tokens, keyword or command first
+ * @param numTok number of tokens, at least one
+ * @param block statements opening blocks not yet ended
+ * @param depth number of blocks not yet ended
+ * @return int UP_STATUS_OK, or error status
+ */
+static int compileStatement(uP_Program * prog, char const ** tok, int numTok, short * block, int * depth)
+{
+  short idx = prog->numOps;
+  uP_Op * op = &prog->op[idx];
+  int i;
+
+  // "end" of an if or else block needs no statement of its own - the block just skips to whatever follows.
+  if (strcmp(tok[0], "end") == 0)
+  {
+    if (*depth == 0)
+      return UP_STATUS_PARAMS;
+    short open = block[--(*depth)];
+    if (prog->op[open].op != PROG_REPEAT)
+    {
+      prog->op[open].next = idx;
+      return UP_STATUS_OK;
+    }
+  }
+
+  if (idx >= MAX_PROGRAM_OPS)
+    return UP_STATUS_OVERFLOW;
+  memset(op, 0, sizeof(*op));
+  op->aVar = -1;
+  op->bVar = -1;
+
+  if (strcmp(tok[0], "end") == 0)
+  {
+    // End of repeat block loops back to the repeat, which skips past here when done.
+    op->op = PROG_END;
+    op->first = block[*depth];
+    prog->op[op->first].next = idx + 1;
+  } else if (strcmp(tok[0], "repeat") == 0)
+  {
+    if ((numTok != 2) || (*depth >= MAX_PROGRAM_DEPTH) || !compileOperand(prog, tok[1], &op->aVar, &op->aValue))
+      return UP_STATUS_PARAMS;
+    op->op = PROG_REPEAT;
+    block[(*depth)++] = idx;
+  } else if (strcmp(tok[0], "if") == 0)
+  {
+    if ((numTok != 2) || (*depth >= MAX_PROGRAM_DEPTH))
+      return UP_STATUS_PARAMS;
+    if (strcmp(tok[1], "ok") == 0)
+      op->op = PROG_IF_OK;
+    else if (strcmp(tok[1], "fail") == 0)
+      op->op = PROG_IF_FAIL;
+    else
+      return UP_STATUS_PARAMS;
+    block[(*depth)++] = idx;
+  } else if (strcmp(tok[0], "else") == 0)
+  {
+    // The if block skips to just past here, and this (the end of the if block) skips to the matching end.
+    if ((*depth == 0) || ((prog->op[block[*depth-1]].op != PROG_IF_OK) && (prog->op[block[*depth-1]].op != PROG_IF_FAIL)))
+      return UP_STATUS_PARAMS;
+    op->op = PROG_ELSE;
+    prog->op[block[*depth-1]].next = idx + 1;
+    block[*depth-1] = idx;
+  } else if (strcmp(tok[0], "let") == 0)
+  {
+    // let <var> <a> [+|- <b>], defining the variable if new.
+    if ((numTok != 3) && (numTok != 5))
+      return UP_STATUS_PARAMS;
+    for (i=0;i<prog->numVars;i++)
+      if (strcmp(prog->varName[i], tok[1]) == 0)
+        break;
+    if (i >= prog->numVars)
+    {
+      if ((i >= MAX_PROGRAM_VARS) || (strlen(tok[1]) > MAX_STR))
+        return UP_STATUS_OVERFLOW;
+      strcpy(prog->varName[i], tok[1]);
+      prog->numVars++;
+    }
+    op->op = PROG_LET;
+    op->first = i;
+    if (!compileOperand(prog, tok[2], &op->aVar, &op->aValue))
+      return UP_STATUS_PARAMS;
+    if (numTok == 5)
+    {
+      if (strcmp(tok[3], "+") == 0)
+        op->bSign = 1;
+      else if (strcmp(tok[3], "-") == 0)
+        op->bSign = -1;
+      else
+        return UP_STATUS_PARAMS;
+      if (!compileOperand(prog, tok[4], &op->bVar, &op->bValue))
+        return UP_STATUS_PARAMS;
+    }
+  } else
+  {
+    // Command: resolve handler now, and keep parameters already split.
+    i = findCommand(tok[0]);
+    if (i < 0)
+      return UP_STATUS_UNKNOWN;
+    if (g_s->reg->cmd[i].handler == NULL)
+      return UP_STATUS_PARAMS;    // streaming commands take raw lines, not compiled parameters
+    if (prog->numParams + numTok-1 > MAX_PROGRAM_PARAMS)
+      return UP_STATUS_OVERFLOW;
+
+    op->op = PROG_COMMAND;
+    op->cmd = g_s->reg->cmd[i].cmd;
+    op->handler = g_s->reg->cmd[i].handler;
+    op->first = prog->numParams;
+    op->numParams = numTok-1;
+    for (i=1;i<numTok;i++)
+    {
+      // A variable of the script, or failing that, of the session when run - as typed, $name is left as it is without one.
+      short var = (tok[i][0] == '$') ? findProgramVar(prog, &tok[i][1]) : -1;
+#if UP_VARIABLES
+      if ((tok[i][0] == '$') && (var < 0))
+        var = PARAM_SESSION_VAR;
+#endif
+      prog->paramVar[prog->numParams] = var;
+      prog->param[prog->numParams++] = tok[i];
+      if (var != -1)
+        op->numVarParams++;
+    }
+  }
+
+  prog->numOps++;
+  return UP_STATUS_OK;
+}
+
+/**
+ * @brief Compile a number, or a variable reference given as $<var>.
+ * 
+ * @param prog program, for its variables
+ * @param str operand string
+ * @param var receives variable index, or -1 if a number
+ * @param value receives number, if not a variable
+ * @return true if valid: a number, or a variable already defined
+ */
+static bool compileOperand(uP_Program * prog, const char * str, short * var, long * value)
+{
+  if (str[0] == '$')
+  {
+    *var = findProgramVar(prog, &str[1]);
+    return *var >= 0;
+  }
+
+  char * end;
+  *var = -1;
+  *value = strtol(str, &end, 0);
+  return (end != str) && (*end == '\0');
+}
+
+/**
+ * @brief Find a variable of a compiled script.
+ * 
+ * @param prog program
+ * @param name variable name, without '$'
+ * @return int index of variable, or -1 if the script has none of that name
+ */
+static int findProgramVar(const uP_Program * prog, const char * name)
+{
+  int i;
+  for (i=0;i<prog->numVars;i++)
+    if (strcmp(prog->varName[i], name) == 0)
+      return i;
+  return -1;
+}
+
+/**
+ * @brief Find a variable named by a statement that failed to compile, which the script has no variable of, to report it
+ * rather than the statement. Session variables can't be operands of repeat or let, since they are not numbers until run.
+ * 
+ * @param prog program
+ * @param tok statement tokens
+ * @param numTok number of tokens
+ * @return const char* first token naming an unknown variable, as $name, or NULL if none
+ */
+static const char * unknownVariable(const uP_Program * prog, char const * const * tok, int numTok)
+{
+  int i;
+  for (i=(strcmp(tok[0], "let") == 0) ? 2 : 1;i<numTok;i++)
+    if ((tok[i][0] == '$') && (findProgramVar(prog, &tok[i][1]) < 0))
+      return tok[i];
+  return NULL;
+}
+
+/**
+ * @brief Run a compiled script, see uP_RunProgram().
+ * 
+ * @param prog compiled script
+ * @return int status of the last command run
+ */
+static int runProgram(uP_Program * prog)
+{
+  struct
+  {
+    short op;     // repeat statement
+    long count;   // repetitions left, including current
+  } loop[MAX_PROGRAM_DEPTH];
+  int depth = 0;
+  int status = UP_STATUS_OK;
+  int pc = 0;
+
+  memset(prog->var, 0, sizeof(prog->var));
+
+  while (pc < prog->numOps)
+  {
+    uP_Op * op = &prog->op[pc++];
+    long a = (op->aVar >= 0) ? prog->var[op->aVar] : op->aValue;
+    long b = (op->bVar >= 0) ? prog->var[op->bVar] : op->bValue;
+
+    switch (op->op)
+    {
+      case PROG_COMMAND:
+        g_status = UP_STATUS_OK;
+        if (op->numVarParams == 0)
+        {
+          // Parameters are all constant, so use them where they are.
+          op->handler(op->cmd, &prog->param[op->first], op->numParams);
+        } else
+        {
+          char const * param[MAX_PARAMETERS];
+          char varText[MAX_PARAMETERS][sizeof("-9223372036854775808")];   // room for any long, 64 bits included
+          int i;
+          for (i=0;i<op->numParams;i++)
+          {
+            int var = prog->paramVar[op->first + i];
+            if (var >= 0)
+            {
+              snprintf(varText[i], sizeof(varText[i]), "%ld", prog->var[var]);
+              param[i] = varText[i];
+            }
+#if UP_VARIABLES
+            else if (var == PARAM_SESSION_VAR)
+            {
+              param[i] = variableValue(prog->param[op->first + i]);
+            }
+#endif
+            else
+            {
+              param[i] = prog->param[op->first + i];
+            }
+          }
+          op->handler(op->cmd, param, op->numParams);
+        }
+        status = g_status;
+        break;
+      case PROG_REPEAT:
+        if (a <= 0)
+        {
+          pc = op->next;
+        } else
+        {
+          loop[depth].op = pc - 1;
+          loop[depth].count = a;
+          depth++;
+        }
+        break;
+      case PROG_END:
+        if (--loop[depth-1].count > 0)
+          pc = loop[depth-1].op + 1;
+        else
+          depth--;
+        break;
+      case PROG_IF_OK:
+        if (status != UP_STATUS_OK)
+          pc = op->next;
+        break;
+      case PROG_IF_FAIL:
+        if (status == UP_STATUS_OK)
+          pc = op->next;
+        break;
+      case PROG_ELSE:
+        pc = op->next;
+        break;
+      case PROG_LET:
+        prog->var[op->first] = a + op->bSign * b;
+        break;
+    }
+  }
+
+  g_status = status;
+  return status;
+}
+#endif
+
+#if UP_FEATURE_STREAM
+/**
+ * @brief On a space typed at the end of a line, check whether the line so far is a streaming command, and if so, start streaming.
+ * 
+ * @return true if streaming started
+ */
+static bool startStream(void)
+{
+  // Only when appending to a line holding nothing but the command.
+  if ((g_s->editIdx >= 0) && (g_s->editIdx != g_s->lineIdx))
+    return false;
+  g_s->lineBuf[g_s->lineIdx] = '\0';
+  int idx = findCommand(g_s->lineBuf);
+  if ((idx < 0) || (g_s->reg->cmd[idx].stream == NULL))
+    return false;
+
+#if UP_FEATURE_PASTE
+  settleLine();
+#endif
+  outChar(' ');
+  g_s->streamIdx = idx;
+  g_s->streamLen = 0;
+  return true;
+}
+
+/**
+ * @brief Add a character to the streaming chunk, passing the chunk on when full, or on line-end.
+ * The chunk is kept in the line buffer, following the command string and its null-terminator.
+ * 
+ * @param c next character from the input stream
+ */
+static void streamChar(const char c)
+{
+  if ((c == '\r') || (c == '\n'))
+  {
+    // Output of the final call starts on its own line, as for other commands.
+    uP_printf("%s", g_s->outLineEnd);
+    flushStream(true);
+    g_s->streamIdx = -1;
+
+    // Line complete: only the command is kept in history, since the data is unbounded.
+    addHistory(g_s->lineBuf);
+    g_s->lineIdx = 0;
+    g_s->editIdx = -1;
+    g_s->lastChar = c;   // so the other half of a c/r-l/f pair ends nothing further
+    g_s->recallIdx = -1;
+    uP_printf("%s%s", g_s->outLineEnd, g_s->prompt);
+    return;
+  }
+
+  if ((c < ' ') || (c > '~'))
+    return;
+
+  g_s->lineBuf[g_s->lineIdx + 1 + g_s->streamLen++] = c;
+  if (g_s->lineIdx + 1 + g_s->streamLen >= g_s->lineSize-1)
+    flushStream(false);
+}
+
+/**
+ * @brief Pass the streaming chunk to the streaming handler.
+ * 
+ * @param final true if this is the end of the data for the line
+ */
+static void flushStream(bool final)
+{
+  char * chunk = &g_s->lineBuf[g_s->lineIdx + 1];
+  chunk[g_s->streamLen] = '\0';
+  g_status = UP_STATUS_OK;
+  g_s->reg->cmd[g_s->streamIdx].stream(g_s->reg->cmd[g_s->streamIdx].cmd, chunk, g_s->streamLen, final);
+  g_s->streamLen = 0;
+}
+
+/**
+ * @brief Check whether the next command in a line is a streaming command, without modifying the line unless it is.
+ * 
+ * @param line line, or rest of line
+ * @param data receives the rest of the line following the command, if a streaming command
+ * @param next receives the rest of the line following a ';' straight after the command (and no data), or NULL
+ * @return int index of the streaming handler, or -1 if not a streaming command
+ */
+static int streamCommand(char * line, char ** data, char ** next)
+{
+  while ((*line == ' ') || (*line == ','))
+    line++;
+  int len = strcspn(line, " ,;");
+
+  int i;
+  for (i=0;i<g_s->reg->numCmds;i++)
+  {
+    if ((g_s->reg->cmd[i].stream != NULL) && (strncmp(line, g_s->reg->cmd[i].cmd, len) == 0) && (g_s->reg->cmd[i].cmd[len] == '\0'))
+    {
+      // Data starts after the spaces following the command, unless there is a ';' in the way.
+      char * p = &line[len];
+      *next = NULL;
+      if (*p == ';')
+        *next = p + 1;
+      while (*p == ' ')
+        p++;
+      line[len] = '\0';
+      *data = (*next != NULL) ? &line[len] : p;
+      return i;
+    }
+  }
+  return -1;
+}
+#endif
+
+#if UP_FEATURE_HISTORY
+/**
+ * @brief Find a line of history.
+ * 
+ * @param i index in circular history buffer
+ * @return char* history string
+ */
+static char * histLine(int i)
+{
+  return &g_s->histBuf[i * g_s->lineSize];
+}
+#endif
+
+/**
+ * @brief Track history, including unhandled commands, as a circular ring buffer.
+ * 
+ * @param line line to add
+ */
+static void addHistory(const char * line)
+{
+#if UP_FEATURE_HISTORY
+  if (g_s->histDepth == 0)
+    return;
+  strncpy(histLine(g_s->histIdx), line, g_s->lineSize);
+  g_s->histIdx = (g_s->histIdx + 1) % g_s->histDepth;
+  if (g_s->histUsed < g_s->histDepth)
+    g_s->histUsed++;
+#else
+  (void)line;
+#endif
+}
+
+#if UP_FEATURE_PASTE
+/**
+ * @brief Insert a character at the edit index without echo, deferring output until settleLine() is called.
+ * Used for bulk input such as pasted text, where per-character redraw is wasted effort.
+ * 
+ * @param c printable character to insert
+ */
+static void deferChar(char c)
+{
+  // If first edit of line, set edit index to end of line, same as editLine().
+  if (g_s->editIdx < 0)
+  {
+    g_s->editIdx = g_s->lineIdx;
+    if (g_s->lineIdx == 0)
+      g_s->lineBuf[0] = '\0';
+  }
+
+  // Mark where echo must resume from.
+  if (g_s->deferIdx < 0)
+    g_s->deferIdx = g_s->editIdx;
+
+  // Appending is by far the usual case, so avoid the string shuffle of insertCharAtIndex() for it.
+  if (g_s->editIdx == g_s->lineIdx)
+  {
+    if (g_s->lineIdx >= g_s->lineSize-1)
+      return;
+    g_s->lineBuf[g_s->lineIdx++] = c;
+    g_s->lineBuf[g_s->lineIdx] = '\0';
+    g_s->editIdx++;
+  } else if (insertCharAtIndex(g_s->lineBuf, g_s->editIdx, c, g_s->lineSize))
+  {
+    g_s->editIdx++;
+    g_s->lineIdx++;
+  }
+  g_s->lastChar = c;
+}
+
+/**
+ * @brief Echo any characters deferred by deferChar() in one pass, leaving the output cursor at the edit index.
+ * 
+ */
+static void settleLine(void)
+{
+  if (g_s->deferIdx < 0)
+    return;
+#if UP_FEATURE_HINTS
+  eraseGhostHint();
+#endif
+
+  // Rewrite everything from the first deferred character to end of line, then back up to the edit index.
+  outStr(&g_s->lineBuf[g_s->deferIdx], g_s->lineIdx - g_s->deferIdx);
+  int i;
+  for (i=g_s->editIdx;i<g_s->lineIdx;i++)
+    outChar('\x08');
+  g_s->deferIdx = -1;
+}
+#endif
+
+#if UP_FEATURE_MACHINE
+/**
+ * @brief Receive the next character of a machine-mode request frame, dispatching the command and sending a response frame once complete.
+ * The line buffer receives the command, since it is not otherwise in use in machine mode.
+ * 
+ * @param c next character from the input stream
+ */
+static void machineChar(const char c)
+{
+  uint8_t b = (uint8_t)c;
+
+  // Track CRC over everything but the start of frame and the CRC itself.
+  if ((g_s->frameState != FRAME_SOF) && (g_s->frameState < FRAME_CRC_LO))
+    g_s->frameCrc = crc16(g_s->frameCrc, b);
+
+  switch (g_s->frameState)
+  {
+    case FRAME_SOF:   // ignore anything between frames, such as line-ends a script may add
+      if (b == UP_FRAME_SOF)
+      {
+        g_s->frameCrc = 0xFFFF;
+        g_s->frameState = FRAME_LEN_LO;
+      }
+      break;
+    case FRAME_LEN_LO:
+      g_s->frameLen = b;
+      g_s->frameState = FRAME_LEN_HI;
+      break;
+    case FRAME_LEN_HI:
+      g_s->frameLen |= b << 8;
+      g_s->frameIdx = 0;
+      g_s->frameState = (g_s->frameLen > 0) ? FRAME_PAYLOAD : FRAME_CRC_LO;
+      break;
+    case FRAME_PAYLOAD:
+      // Keep what fits - the rest is still counted, so the frame stays in step, and reported as overflow.
+      if (g_s->frameIdx < g_s->lineSize-1)
+        g_s->lineBuf[g_s->frameIdx] = c;
+      if (++g_s->frameIdx >= g_s->frameLen)
+        g_s->frameState = FRAME_CRC_LO;
+      break;
+    case FRAME_CRC_LO:
+      g_s->frameRxCrc = b;
+      g_s->frameState = FRAME_CRC_HI;
+      break;
+    case FRAME_CRC_HI:
+      g_s->frameRxCrc |= b << 8;
+      g_s->frameState = FRAME_SOF;
+
+      if (g_s->frameRxCrc != g_s->frameCrc)
+      {
+        sendFrame(UP_STATUS_BAD_FRAME, "", 0);
+      } else if (g_s->frameLen == 0)
+      {
+        // Sentinel: acknowledge, then back to interactive mode, with a prompt to show for it.
+        sendFrame(UP_STATUS_OK, "", 0);
+        g_s->machineMode = false;
+        g_s->lineIdx = 0;
+        g_s->lineBuf[0] = '\0';
+        uP_printf("%s%s", g_s->outLineEnd, g_s->prompt);
+      } else if (g_s->frameLen >= g_s->lineSize)
+      {
+        sendFrame(UP_STATUS_OVERFLOW, "", 0);
+      } else
+      {
+        // Dispatch, capturing all output for the response.
+        Sink sink = { g_s->capBuf, g_s->capSize, 0, false, NULL };
+        g_s->lineBuf[g_s->frameLen] = '\0';
+        int status = processLineCaptured(g_s->lineBuf, &sink);
+        sendFrame(status, sink.buf, sink.len);
+      }
+      break;
+  }
+}
+#endif
+
+/**
+ * @brief Process a line as processLine() does, capturing its output rather than sending it to the terminal.
+ * 
+ * @param line string received - modified when parsed
+ * @param sink where to capture output
+ * @return int status of the command, UP_STATUS_OVERFLOW if it succeeded but output was lost
+ */
+static int processLineCaptured(char * line, Sink * sink)
+{
+  Sink * prevSink = g_sink;
+  g_sink = sink;
+  processLine(line);
+  g_sink = prevSink;
+
+  if (sink->overflow && (g_status == UP_STATUS_OK))
+    g_status = UP_STATUS_OVERFLOW;
+  return g_status;
+}
+
+#if UP_FEATURE_JSON
+/**
+ * @brief Process a line in JSON response mode: strip any "@<id>", then process the rest, answering with a JSON object.
+ * 
+ * @param line string received - modified when parsed
+ */
+static void processLineJson(char * line)
+{
+  const char * id = NULL;
+  int idLen = 0;
+
+  // Split off correlation ID, if given.
+  while (*line == ' ')
+    line++;
+  if (*line == '@')
+  {
+    id = ++line;
+    while ((*line != '\0') && (*line != ' '))
+      line++;
+    idLen = line - id;
+  }
+
+  Sink sink = { g_s->capBuf, g_s->capSize, 0, false, NULL };
+  if (isEmptyLine(line))
+    g_status = UP_STATUS_OK;    // ID alone is a no-op, but still answered, as a ping
+  else
+    processLineCaptured(line, &sink);
+
+  // {"id":"<id>","status":<n>,"out":"<output>"}
+  char num[8];
+  sprintf(num, "%d", g_status);
+  rawJsonString("{\"id\":", -1);
+  if (id)
+  {
+    rawChar('"');
+    rawJsonString(id, idLen);
+    rawChar('"');
+  } else
+  {
+    rawJsonString("null", -1);
+  }
+  rawJsonString(",\"status\":", -1);
+  rawJsonString(num, -1);
+  rawJsonString(",\"out\":\"", -1);
+  rawJsonString(sink.buf, sink.len);
+  rawJsonString("\"}\n", -1);
+}
+
+/**
+ * @brief Send a string straight to the terminal, escaped for use within a JSON string where needed.
+ * Structural text (which never needs escaping) is sent with a length of -1.
+ * 
+ * @param str string to send
+ * @param len number of characters to send, escaped, or -1 to send a null-terminated string as is
+ */
+static void rawJsonString(const char * str, int len)
+{
+  const char kHex[] = "0123456789abcdef";
+  int i;
+
+  if (len < 0)
+  {
+    while (*str)
+      rawChar(*str++);
+    return;
+  }
+
+  for (i=0;i<len;i++)
+  {
+    unsigned char c = (unsigned char)str[i];
+    if ((c == '"') || (c == '\\'))
+    {
+      rawChar('\\');
+      rawChar(c);
+    } else if (c == '\n')
+    {
+      rawChar('\\');
+      rawChar('n');
+    } else if (c == '\r')
+    {
+      rawChar('\\');
+      rawChar('r');
+    } else if (c == '\t')
+    {
+      rawChar('\\');
+      rawChar('t');
+    } else if (c < ' ')
+    {
+      rawChar('\\');
+      rawChar('u');
+      rawChar('0');
+      rawChar('0');
+      rawChar(kHex[c >> 4]);
+      rawChar(kHex[c & 0x0F]);
+    } else
+    {
+      rawChar(c);
+    }
+  }
+}
+#endif
+
+#if UP_FEATURE_MACHINE
+/**
+ * @brief Send a machine-mode response frame, straight to the terminal.
+ * 
+ * @param status status of the command, UP_STATUS_
+ * @param payload command output
+ * @param len number of characters of output
+ */
+static void sendFrame(int status, const char * payload, int len)
+{
+  uint8_t header[3] = { (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)status };
+  uint16_t crc = 0xFFFF;
+  int i;
+
+  rawChar(UP_FRAME_SOF);
+  for (i=0;i<(int)sizeof(header);i++)
+  {
+    crc = crc16(crc, header[i]);
+    rawChar(header[i]);
+  }
+  for (i=0;i<len;i++)
+  {
+    crc = crc16(crc, (uint8_t)payload[i]);
+    rawChar(payload[i]);
+  }
+  rawChar(crc & 0xFF);
+  rawChar(crc >> 8);
+}
+
+/**
+ * @brief Add a byte to a CRC-16/CCITT-FALSE, a nibble at a time, trading a little speed for a table of only 16 entries.
+ * 
+ * @param crc CRC so far, starting with 0xFFFF
+ * @param b next byte
+ * @return uint16_t updated CRC
+ */
+static uint16_t crc16(uint16_t crc, uint8_t b)
+{
+  static const uint16_t kCrcNibble[16] =
+  {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  };
+  crc = (uint16_t)(crc << 4) ^ kCrcNibble[(crc >> 12) ^ (b >> 4)];
+  crc = (uint16_t)(crc << 4) ^ kCrcNibble[(crc >> 12) ^ (b & 0x0F)];
+  return crc;
+}
+#endif
+
+/**
+ * @brief Insert character before index in line, extending line accordingly.
+ * Only allows inserting from start of line (prepend) to end of line (append).
+ * Will not allow line to grow beyond line buffer size given.
+ * 
+ * @param line ASCIIZ line string
+ * @param idx index of character before which to add the given character
+ * @param c character to insert
+ * @param lineSize size of line buffer, including one for null-terminator (sizeof(line))
+ * @return true if character successfully inserted in the line buffer
+ */
+static bool insertCharAtIndex(char * line, int idx, char c, int lineSize)
+{
+  int len = strlen(line);
+
+  // Fail-safe: index must be within, or at end, of line.
+  if ((idx < 0) || (idx > len))
+    return false;
+
+  // Fail-safe: can not insert a character into a line already at maximum length.
+  if ((len+1) >= lineSize)
+    return false;
+
+  int i;
+  for (i=len;i>=idx;i--)
+    line[i+1] = line[i];
+  line[idx] = c;
+
+  // Successful insert
+  return true;
+}
+
+/**
+ * @brief Parses complete string received, then identifies and processes each command, with parameters.
+ * A line may hold several commands separated by ';', processed in order, as "reset; cal 3; read all".
+ * A command's output may be piped through filters, as "log | grep err | count", see runPipe().
+ * This will change the line buffer passed, as it is parsed. In fact, the pointers to the command and each
+ * parameter string are actually just pointers into the line string. This works for a single-threaded system,
+ * as long as the command and parameter strings are used by the handler before any more characters are processed,
+ * since this begins to overwrite that line again.
+ * 
+ * @param line string received - modified when parsed by tokenize()
+ * @return true if every command recognized and handled
+ */
+static bool processLine(char * line)
+{
+    bool handled = false;
+    int status = UP_STATUS_OK;
+    int numCmds = 0;
+
+    // Nothing to parse if empty string, or contains only line-end characters.
+    if ((line == NULL) || (line[0] == '\0'))
+      return false;   // return no command handled
+
+    // Split off and process one command at a time, stopping only at the end of the line.
+    // Status is that of the first command to fail, if any.
+    while (line != NULL)
+    {
+      char const * tok[MAX_PARAMETERS+1];   // command followed by its parameters
+      int numTok;
+      int idx;
+
+#if UP_FEATURE_STREAM
+      // A streaming command takes the rest of the line as its data, in one chunk.
+      char * data;
+      if ((g_s->reg->numStreamCmds > 0) && ((idx = streamCommand(line, &data, &line)) >= 0))
+      {
+        g_status = UP_STATUS_OK;
+        g_s->reg->cmd[idx].stream(g_s->reg->cmd[idx].cmd, data, strlen(data), true);
+        handled = (numCmds == 0) ? true : handled;
+        numCmds++;
+        if (status == UP_STATUS_OK)
+          status = g_status;
+        continue;
+      }
+#endif
+
+#if UP_PIPES
+      // A command whose output is piped through others.
+      if (line[pipeEnd(line)] == '|')
+      {
+        bool ok;
+        line = runPipe(line, &ok);
+        handled = (numCmds == 0) ? ok : (handled && ok);
+        numCmds++;
+        if (status == UP_STATUS_OK)
+          status = g_status;
+        continue;
+      }
+#endif
+
+#if UP_PARSE_CACHE
+      line = parseCached(line, tok, &numTok, &idx);
+#else
+      line = tokenize(line, tok, NUM_ELEMENTS(tok), &numTok, true);
+      idx = (numTok > 0) ? findCommand(tok[0]) : -1;
+#endif
+      if (numTok == 0)
+        continue;   // nothing between separators
+
+      bool ok = dispatch(idx, tok, numTok);
+      handled = (numCmds == 0) ? ok : (handled && ok);
+      numCmds++;
+      if (status == UP_STATUS_OK)
+        status = g_status;
+    }
+
+    g_status = status;
+    return handled;
+}
+
+/**
+ * @brief Split the next command off a line into tokens, in place, as strtok() would, in a single pass.
+ * Tokens are separated by spaces or commas. A token starting with a double-quote runs to the closing quote,
+ * and may contain spaces, commas and semicolons. An unquoted ';' ends the command. Tokens beyond maxTok are dropped.
+ * If asked, an unquoted parameter naming a variable, as $name, is replaced by its value in the same pass, by pointing to the
+ * value where it is kept, so the line is not copied. A parameter naming no variable is left as it is.
+ * 
+ * @param line line, or rest of line, to split - separators are replaced by null-terminators
+ * @param tok receives pointers to each token, the first being the command
+ * @param maxTok size of the tok[] list
+ * @param numTok receives number of tokens found, which may be zero
+ * @param vars true to substitute variables, see variableValue()
+ * @return char* rest of line following ';', or NULL if this was the last command in the line
+ */
+static char * tokenize(char * line, char const ** tok, int maxTok, int * numTok, bool vars)
+{
+  char * p = line;
+  *numTok = 0;
+
+  while (true)
+  {
+    // Skip separators between tokens, stopping at end of line or end of command.
+    while ((*p == ' ') || (*p == ','))
+      p++;
+    if (*p == '\0')
+      return NULL;
+    if (*p == ';')
+    {
+      *p = '\0';
+      return p + 1;
+    }
+
+    // Find end of token.
+    char * start = p;
+    if (*p == '"')
+    {
+      start = ++p;
+      while ((*p != '\0') && (*p != '"'))
+        p++;
+    } else
+    {
+      while ((*p != '\0') && (*p != ' ') && (*p != ',') && (*p != ';'))
+        p++;
+    }
+    bool kept = (*numTok < maxTok);
+    if (kept)
+      tok[(*numTok)++] = start;
+
+    // Terminate token, noting whether it also ends the command.
+    char sep = *p;
+    *p = '\0';
+#if UP_VARIABLES
+    if (vars && kept && (*numTok > 1) && (start[0] == '$') && (start[-1] != '"'))
+      tok[*numTok-1] = variableValue(start);
+#else
+    (void)vars;
+#endif
+    if (sep == '\0')
+      return NULL;
+    if (sep == ';')
+      return p + 1;
+    p++;    // past space, comma or closing quote
+  }
+}
+
+#if UP_PARSE_CACHE
+/**
+ * @brief Split the next command off a line and look it up, as tokenize() and findCommand() would, but using the result
+ * for the same command text from the cache, if there. On a hit, the command is split by null-terminating its tokens where
+ * they were before, with no further scanning or look-up (other than of the value of any variable given as a parameter).
+ * 
+ * @param line line, or rest of line, to split - separators are replaced by null-terminators
+ * @param tok receives pointers to each token, the first being the command
+ * @param numTok receives number of tokens found, which may be zero
+ * @param cmdIdx receives index of command handler, or -1 if unknown
+ * @return char* rest of line following ';', or NULL if this was the last command in the line
+ */
+static char * parseCached(char * line, char const ** tok, int * numTok, int * cmdIdx)
+{
+  uint32_t hash;
+  int len = commandLength(line, &hash);
+  char * next = (line[len] == ';') ? &line[len+1] : NULL;
+  ParseCacheEntry * e = &g_parseCache[0];
+  int i;
+
+  // Cached command indexes only hold for the registry they were looked up in.
+  if (g_parseCacheReg != g_s->reg)
+  {
+    memset(g_parseCache, 0, sizeof(g_parseCache));
+    g_parseCacheReg = g_s->reg;
+  }
+  g_parseCacheClock++;
+
+  // Look for hit, noting least recently used entry as we go, to replace on a miss.
+  for (i=0;i<UP_PARSE_CACHE;i++)
+  {
+    ParseCacheEntry * c = &g_parseCache[i];
+    if ((c->len == len) && (c->hash == hash) && (memcmp(c->text, line, len) == 0))
+    {
+      int t;
+      for (t=0;t<c->numTok;t++)
+      {
+        tok[t] = &line[c->tokStart[t]];
+        line[c->tokEnd[t]] = '\0';
+#if UP_VARIABLES
+        if (c->vars & (1u << t))
+          tok[t] = variableValue(tok[t]);
+#endif
+      }
+      if (next)
+        line[len] = '\0';
+      *numTok = c->numTok;
+      *cmdIdx = c->cmdIdx;
+      c->used = g_parseCacheClock;
+      g_parseCacheHits++;
+      return next;
+    }
+    if ((unsigned short)(g_parseCacheClock - c->used) > (unsigned short)(g_parseCacheClock - e->used))
+      e = c;
+  }
+
+  // Miss: parse, then cache the result, unless there's nothing worth caching.
+  g_parseCacheMisses++;
+  if ((len == 0) || (len >= (int)sizeof(e->text)))
+  {
+    next = tokenize(line, tok, MAX_PARAMETERS+1, numTok, true);
+    *cmdIdx = (*numTok > 0) ? findCommand(tok[0]) : -1;
+    return next;
+  }
+  memcpy(e->text, line, len);
+  next = tokenize(line, tok, MAX_PARAMETERS+1, numTok, false);
+  *cmdIdx = (*numTok > 0) ? findCommand(tok[0]) : -1;
+  e->len = len;
+  e->hash = hash;
+  e->used = g_parseCacheClock;
+  e->cmdIdx = *cmdIdx;
+  e->numTok = *numTok;
+  e->vars = 0;
+  for (i=0;i<*numTok;i++)
+  {
+    e->tokStart[i] = tok[i] - line;
+    e->tokEnd[i] = e->tokStart[i] + strlen(tok[i]);
+#if UP_VARIABLES
+    // Parameters naming variables, as tokenize() would substitute them, but noted so as to do so on each hit.
+    if ((i > 0) && (tok[i][0] == '$') && (tok[i][-1] != '"'))
+    {
+      e->vars |= 1u << i;
+      tok[i] = variableValue(tok[i]);
+    }
+#endif
+  }
+  return next;
+}
+
+/**
+ * @brief Find the length of the next command in a line, up to an unquoted ';' or end of line, following the same quoting rules
+ * as tokenize(). Also hashes the command (FNV-1a) on the way.
+ * 
+ * @param line line, or rest of line
+ * @param hash receives hash of command text
+ * @return int number of characters in command
+ */
+static int commandLength(const char * line, uint32_t * hash)
+{
+  const char * p = line;
+  uint32_t h = 2166136261u;
+  bool tokStart = true;
+  bool quoted = false;
+
+  for (;*p != '\0';p++)
+  {
+    if (quoted)
+    {
+      if (*p == '"')
+      {
+        quoted = false;
+        tokStart = true;
+      }
+    } else if (*p == ';')
+    {
+      break;
+    } else if ((*p == ' ') || (*p == ','))
+    {
+      tokStart = true;
+    } else
+    {
+      quoted = tokStart && (*p == '"');
+      tokStart = false;
+    }
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  }
+
+  *hash = h;
+  return p - line;
+}
+
+/**
+ * @brief Report how well the parse cache is doing.
+ * 
+ * @param hits receives number of commands found in cache
+ * @param misses receives number of commands parsed afresh
+ */
+void uP_getParseCacheStats(unsigned long * hits, unsigned long * misses)
+{
+  if (hits)
+    *hits = g_parseCacheHits;
+  if (misses)
+    *misses = g_parseCacheMisses;
+}
+#endif
+
+/**
+ * @brief Look up a command in the g_s->reg->cmd table.
+ * 
+ * @param cmd command string
+ * @return int index of command handler, or -1 if unknown
+ */
+static int findCommand(const char * cmd)
+{
+    // Loook for match in g_s->reg->cmd table.
+    int i;
+    for (i=0;i<g_s->reg->numCmds;i++)
+      if ((g_s->reg->cmd[i].cmd != NULL) && (strcmp(cmd, g_s->reg->cmd[i].cmd) == 0))
+        return i;
+    return -1;
+}
+
+/**
+ * @brief Call a command's handler, or expand an alias, or call the unhandled-command handler if the command is unknown.
+ * 
+ * @param idx index of command handler, or -1 if unknown
+ * @param tok command followed by its parameters
+ * @param numTok number of tokens, at least one
+ * @return true if command recognized and handled
+ */
+static bool dispatch(int idx, char const * const * tok, int numTok)
+{
+    if (idx >= 0)
+    {
+      g_status = UP_STATUS_OK;
+      if (g_s->reg->cmd[idx].handler)
+        g_s->reg->cmd[idx].handler(tok[0], &tok[1], numTok-1);
+#if UP_FEATURE_STREAM
+      else
+        g_s->reg->cmd[idx].stream(tok[0], "", 0, true);   // streaming commands are caught before here, but just in case
+#endif
+      return true;
+    }
+
+#if UP_ALIASES
+    // An alias, if not a command.
+    int a = findAlias(tok[0]);
+    if (a >= 0)
+      return expandAlias(a, tok, numTok);
+#endif
+
+    // If not handled above.
+    handle_unhandled(tok[0], &tok[1], numTok-1);
+    return false;   // return no command handled
+}
+
+#if UP_PIPES
+/**
+ * @brief Find the end of a command, or of one stage of a pipe: the first '|' or ';' not in quotes, following the same
+ * quoting rules as tokenize().
+ * 
+ * @param str line, or rest of line
+ * @return int index of '|', ';' or null-terminator
+ */
+static int pipeEnd(const char * str)
+{
+  const char * p = str;
+  bool tokStart = true;
+  bool quoted = false;
+
+  for (;*p != '\0';p++)
+  {
+    if (quoted)
+    {
+      if (*p == '"')
+      {
+        quoted = false;
+        tokStart = true;
+      }
+    } else if ((*p == '|') || (*p == ';'))
+    {
+      break;
+    } else if ((*p == ' ') || (*p == ','))
+    {
+      tokStart = true;
+    } else
+    {
+      quoted = tokStart && (*p == '"');
+      tokStart = false;
+    }
+  }
+  return p - str;
+}
+
+/**
+ * @brief Run a command with its output piped through the stages that follow it, as "dump 0 256 | grep FF | count".
+ * The command's output is captured once in g_pipeBuf[], and split into lines, which each stage passes to the next as slices
+ * of the buffer, without copying. A stage is a built-in filter:
+ *   grep [-v] <text> : lines containing text (or with -v, not containing it)
+ *   head [<n>]       : first n lines, 10 by default
+ *   tail [<n>]       : last n lines, 10 by default
+ *   count            : number of lines
+ * or a streaming handler, given the lines as its data, whose own output is passed on. What comes out of the last stage is
+ * output as usual.
+ * 
+ * @param line line, or rest of line, starting with the command - modified when parsed
+ * @param handled receives true if the command and every stage were recognized and handled
+ * @return char* rest of line following ';', or NULL if this was the last command in the line
+ */
+static char * runPipe(char * line, bool * handled)
+{
+  char const * tok[MAX_PARAMETERS+1];
+  int numTok;
+  int end = pipeEnd(line);
+  int status;
+  int i;
+
+  *handled = false;
+  if (g_piping)
+  {
+    uP_printf("*** Pipes can't be nested ***%s", g_s->outLineEnd);
+    g_status = UP_STATUS_FAILED;
+    while (line[end] == '|')
+      end += 1 + pipeEnd(&line[end+1]);
+    return (line[end] == ';') ? &line[end+1] : NULL;
+  }
+
+  // Run the command, capturing its output, less room kept back for filters.
+  Sink sink = { g_pipeBuf, sizeof(g_pipeBuf) - PIPE_RESERVE, 0, false, NULL };
+  Sink * prevSink = g_sink;
+  line[end] = '\0';
+  tokenize(line, tok, NUM_ELEMENTS(tok), &numTok, true);
+  g_piping = true;
+  g_sink = &sink;
+  *handled = (numTok > 0) && dispatch(findCommand(tok[0]), tok, numTok);
+  g_sink = prevSink;
+  status = g_status;
+  g_numSlices = 0;
+  if (sliceLines(0, sink.len) < 0)
+    sink.overflow = true;
+
+  // Pass the lines through each stage in turn, each stage ending at '|', or the last at ';' or end of line.
+  // Once a stage fails, the rest are skipped.
+  char * stage = &line[end+1];
+  char * rest = NULL;
+  bool more = true;
+  while (more)
+  {
+    end = pipeEnd(stage);
+    more = (stage[end] == '|');
+    if (stage[end] == ';')
+      rest = &stage[end+1];
+    char * after = &stage[end+1];
+    stage[end] = '\0';
+    tokenize(stage, tok, NUM_ELEMENTS(tok), &numTok, true);
+    if ((status == UP_STATUS_OK) && !pipeStage(tok, numTok, &sink))
+    {
+      *handled = false;
+      status = g_status;
+      g_numSlices = 0;
+    }
+    stage = after;
+  }
+  g_piping = false;
+
+  // Output what is left.
+  for (i=0;i<g_numSlices;i++)
+    outStr(&g_pipeBuf[g_pipeSlice[i].start], g_pipeSlice[i].len);
+  if (sink.overflow)
+  {
+    if ((g_numSlices > 0) && (g_pipeBuf[g_pipeSlice[g_numSlices-1].start + g_pipeSlice[g_numSlices-1].len - 1] != '\n'))
+      outStr(g_s->outLineEnd, strlen(g_s->outLineEnd));
+    uP_printf("*** Pipe overflowed: output lost ***%s", g_s->outLineEnd);
+    if (status == UP_STATUS_OK)
+      status = UP_STATUS_OVERFLOW;
+  }
+  g_status = status;
+  return rest;
+}
+
+/**
+ * @brief Run one stage of a pipe on the lines in g_pipeSlice[], see runPipe().
+ * 
+ * @param tok filter or streaming command, followed by its parameters
+ * @param numTok number of tokens
+ * @param sink capture of the command's output, extended by any streaming handler's output
+ * @return true if recognized and handled
+ */
+static bool pipeStage(char const * const * tok, int numTok, Sink * sink)
+{
+  int n = 10;
+  int i;
+
+  g_status = UP_STATUS_OK;
+  if (numTok == 0)
+  {
+    uP_printf("*** Nothing to pipe to ***%s", g_s->outLineEnd);
+    g_status = UP_STATUS_PARAMS;
+    return false;
+  }
+  if ((numTok > 1) && ((strcmp(tok[0], "head") == 0) || (strcmp(tok[0], "tail") == 0)))
+    n = atoi(tok[1]);
+
+  if (strcmp(tok[0], "grep") == 0)
+  {
+    // Keep lines containing the text (or with -v, not containing it).
+    bool invert = (numTok > 2) && (strcmp(tok[1], "-v") == 0);
+    if (!uP_confirmParameters(numTok-1, invert ? 2 : 1))
+      return false;
+    const char * str = tok[invert ? 2 : 1];
+    int len = strlen(str);
+    int kept = 0;
+    for (i=0;i<g_numSlices;i++)
+      if (sliceContains(&g_pipeSlice[i], str, len) != invert)
+        g_pipeSlice[kept++] = g_pipeSlice[i];
+    g_numSlices = kept;
+  } else if (strcmp(tok[0], "head") == 0)
+  {
+    if ((n >= 0) && (n < g_numSlices))
+      g_numSlices = n;
+  } else if (strcmp(tok[0], "tail") == 0)
+  {
+    if ((n >= 0) && (n < g_numSlices))
+    {
+      memmove(&g_pipeSlice[0], &g_pipeSlice[g_numSlices - n], n * sizeof(g_pipeSlice[0]));
+      g_numSlices = n;
+    }
+  } else if (strcmp(tok[0], "count") == 0)
+  {
+    // Count, written in room kept back for it after the command's output.
+    int start = sink->len;
+    int len = snprintf(&g_pipeBuf[start], sizeof(g_pipeBuf) - start, "%d%s", g_numSlices, g_s->outLineEnd);
+    g_numSlices = 0;
+    if ((len > 0) && (start + len <= (int)sizeof(g_pipeBuf)))
+    {
+      sliceLines(start, len);
+      sink->len += len;
+    }
+  } else
+  {
+#if UP_FEATURE_STREAM
+    // A streaming handler, given the lines as its data, one chunk each, its output captured after what came before.
+    int idx = findCommand(tok[0]);
+    if ((idx < 0) || (g_s->reg->cmd[idx].stream == NULL))
+#endif
+    {
+      uP_printf("*** Can't pipe to \"%s\" ***%s", tok[0], g_s->outLineEnd);
+      g_status = UP_STATUS_UNKNOWN;
+      return false;
+    }
+#if UP_FEATURE_STREAM
+    int start = sink->len;
+    Sink * prevSink = g_sink;
+    g_sink = sink;
+    for (i=0;i<g_numSlices;i++)
+      g_s->reg->cmd[idx].stream(tok[0], &g_pipeBuf[g_pipeSlice[i].start], g_pipeSlice[i].len, false);
+    g_s->reg->cmd[idx].stream(tok[0], "", 0, true);
+    g_sink = prevSink;
+    g_numSlices = 0;
+    if (sliceLines(start, sink->len - start) < 0)
+      sink->overflow = true;
+#endif
+  }
+  return g_status == UP_STATUS_OK;
+}
+
+/**
+ * @brief Split text in g_pipeBuf[] into lines, adding a slice for each to g_pipeSlice[]. A line ends with '\n', except
+ * perhaps the last.
+ * 
+ * @param start offset of text in g_pipeBuf[]
+ * @param len length of text
+ * @return int number of slices in g_pipeSlice[], or -1 if some lines were lost for lack of room
+ */
+static int sliceLines(int start, int len)
+{
+  const char * p = &g_pipeBuf[start];
+  const char * end = p + len;
+
+  while (p < end)
+  {
+    const char * nl = (const char *)memchr(p, '\n', end - p);
+    const char * next = nl ? nl + 1 : end;
+    if (g_numSlices >= (int)NUM_ELEMENTS(g_pipeSlice))
+      return -1;
+    g_pipeSlice[g_numSlices].start = p - g_pipeBuf;
+    g_pipeSlice[g_numSlices].len = next - p;
+    g_numSlices++;
+    p = next;
+  }
+  return g_numSlices;
+}
+
+/**
+ * @brief Search a line in a pipe for text, not counting its line end.
+ * 
+ * @param slice line
+ * @param str text to look for
+ * @param len length of text
+ * @return true if found
+ */
+static bool sliceContains(const Slice * slice, const char * str, int len)
+{
+  const char * p = &g_pipeBuf[slice->start];
+  const char * end = p + slice->len;
+
+  while ((end > p) && ((end[-1] == '\n') || (end[-1] == '\r')))
+    end--;
+  if (len == 0)
+    return true;
+  while ((p = (const char *)memchr(p, str[0], end - p)) != NULL)
+  {
+    if ((end - p >= len) && (memcmp(p, str, len) == 0))
+      return true;
+    if (++p >= end)
+      break;
+  }
+  return false;
+}
+#endif
+
+/**
+ * @brief Look for escape sequences: known strings starting with an escape character (0x1B).
+ * These include up, down, left and right arrow keys, delete, and various function keys.
+ * The return value indicates the state of gathering an escape sequence:
+ *   -2 : a sequence not matching any known : caller should ignore the incoming character (ESC_UNHANDLED)
+ *   -1 : processing a sequence, not complete : caller should discard the incoming character
+ *    0 : no escape seuence is being gathered : caller should process the character as normal
+ *  0x100+ : a key's escape sequence just recognized : caller should take action based on the key (UP_KEY_), ignoring incoming character
+ *  0x1000+ : a paste marker just recognized (ESC_PASTE_START, ESC_PASTE_END) : caller should start or end taking in pasted text,
+ *          ignoring incoming character
+ *  ESC_LONE : an escape not followed by a sequence : caller should act on the escape key, then process the character as normal
+ * Note thise routine does not validate the character, it only filters and reports on known escape sequences. Caller must insure
+ * that any character not handled here is valid for other purposes.
+ * Note that partial match may cause some incoming characters to be lost.
+ * 
+ * @param c next character to process
+ * @return int 0 if not collecting escape characters, -1 if in process of collecting an escape sequence, or key of recognized escape sequence
+ */
+static int processEscapes(char c)
+{
+// TODO: need to handle any unrecognized escape sequences gracefully - still filter out characters that belong to ones we don't handle here!
+  // Since all strings are null-terminated, we can determine the number of used characters by looking for the null termination. Strings shorter
+  // than the alloted array size for each entry must padd with null(s).
+  static const struct
+  {
+    char seq[ESCAPE_CHARS];
+    short key;
+  } kEscapes[] =
+  {
+    { "\x1B\x5B\x41\x00\x00\x00", UP_KEY_UP },
+    { "\x1B\x5B\x42\x00\x00\x00", UP_KEY_DOWN },
+    { "\x1B\x5B\x43\x00\x00\x00", UP_KEY_RIGHT },
+    { "\x1B\x5B\x44\x00\x00\x00", UP_KEY_LEFT },
+    { "\x1B\x5B\x33\x7E\x00\x00", UP_KEY_DEL },
+    { "\x1B\x5B\x31\x7E\x00\x00", UP_KEY_HOME },
+    { "\x1B\x5B\x34\x7E\x00\x00", UP_KEY_END },
+    { "\x1B\x5B\x31\x3B\x35\x43", UP_KEY_CTRL_RIGHT },
+    { "\x1B\x5B\x31\x3B\x35\x44", UP_KEY_CTRL_LEFT },
+#if UP_FEATURE_PASTE || UP_FEATURE_STREAM
+    { "\x1B\x5B\x32\x30\x30\x7E", ESC_PASTE_START },
+    { "\x1B\x5B\x32\x30\x31\x7E", ESC_PASTE_END },
+#endif
+#if UP_FEATURE_FKEYS
+    { "\x1B\x4F\x50\x00\x00\x00", UP_KEY_F1 },
+    { "\x1B\x4F\x51\x00\x00\x00", UP_KEY_F2 },
+    { "\x1B\x4F\x52\x00\x00\x00", UP_KEY_F3 },
+    { "\x1B\x4F\x53\x00\x00\x00", UP_KEY_F4 },
+    { "\x1B\x5B\x31\x35\x7E\x00", UP_KEY_F5 },
+    { "\x1B\x5B\x31\x37\x7E\x00", UP_KEY_F6 },
+    { "\x1B\x5B\x31\x38\x7E\x00", UP_KEY_F7 },
+    { "\x1B\x5B\x31\x39\x7E\x00", UP_KEY_F8 },
+    { "\x1B\x5B\x32\x30\x7E\x00", UP_KEY_F9 },
+#endif
+  };
+
+  // Establish the next index in the escape sequence, knowing that the array
+  // will be cleared with each new escape character (0x1B).
+  int escIdx;
+  for (escIdx=0;escIdx < sizeof(g_s->escapeChars);escIdx++)
+    if (g_s->escapeChars[escIdx] == 0)
+      break;
+  
+  if (c == '\x1B')
+  {
+    // In all cases, an escape character aborts any previous sequence, so clear the escape sequence buffer.
+    memset(g_s->escapeChars, 0, sizeof(g_s->escapeChars));
+
+    if ((escIdx == 1) && (g_s->escapeChars[0] == '\x1B'))
+    {
+      // If two escapes in a row (one already buffered), tell caller to process escape as a regular character,
+      // and ignore it here.
+      return ESC_NO_ACTION;
+    } else
+    {
+      // Otherwise start buffer with it here, and tell caller that we're currently gathering a possible escape sequence.
+      g_s->escapeChars[0] = c;
+      return ESC_PROCESSING;
+    }
+  }
+
+  // If not an escape character (above), and no escape sequence started, then we take no action, caller should handle as regular character.
+  if (escIdx == 0)
+    return ESC_NO_ACTION;
+
+  // Buffer incoming. Fail-safe: insure index never exceeds buffer.
+  if (escIdx < (sizeof(g_s->escapeChars)-1))
+    g_s->escapeChars[escIdx++] = c;
+
+  // Scan all known sequences for a match.
+  int eseqIdx;
+  for (eseqIdx=0;eseqIdx<NUM_ELEMENTS(kEscapes);eseqIdx++)    
+  {
+    int i;
+    for (i=0;i<escIdx;i++)
+    {
+      // If match so far..
+      if (g_s->escapeChars[i] == kEscapes[eseqIdx].seq[i])
+      {
+        if (kEscapes[eseqIdx].seq[i+1] == '\x00')
+        {
+          // If last before termination, we have a match - return its key.
+          memset(g_s->escapeChars, 0, sizeof(g_s->escapeChars));
+          return kEscapes[eseqIdx].key;
+        }
+      } else
+      {
+        // Mismatch, try next.
+        break;
+      }
+    }
+
+    // All characters match so far, but more to check - return still processing.
+    if (i >= escIdx)
+      return ESC_PROCESSING;
+  }
+
+  // If failed to match any known sequence, reset and tell caller to ignore the latest character, assuming it failed on
+  // the last character - if there are more to a valid escape sequence that we don't recognize, one or more
+  // characters from the end of that sequence my be passed on as regular characters.
+  // An escape followed by anything that can't start a sequence is the escape key alone, and the character is regular.
+  if (eseqIdx >= NUM_ELEMENTS(kEscapes))
+  {
+    memset(g_s->escapeChars, 0, sizeof(g_s->escapeChars));
+    return (escIdx == 2) ? ESC_LONE : ESC_UNHANDLED;
+  } else
+  {
+    // Otherwise waiting on more characters to match - return "still processing".
+    return ESC_PROCESSING;
+  }
+}
+
+/**
+ * @brief Uses the given call-back to feed characters back to caller's stdout, either by calling
+ * given call-back function, or buffering until return (if cb_out is NULL). Captured instead while a sink is set,
+ * and dropped in JSON response mode, where the terminal sees only JSON responses.
+ * 
+ * @param c character to try to write to caller's stdout
+ */
+static void outChar(const char c)
+{
+  // If capturing, as for a machine-mode response, keep what fits and flag the rest as lost.
+  if (g_sink)
+  {
+    if (g_sink->cb_out)
+      g_sink->cb_out(c);
+    else if (g_sink->len < g_sink->size)
+      g_sink->buf[g_sink->len++] = c;
+    else
+      g_sink->overflow = true;
+    return;
+  }
+
+#if UP_FEATURE_JSON
+  // In JSON response mode, only the JSON responses go to the terminal - no echo or prompt.
+  if (g_s->responseMode == UP_RESPONSE_JSON)
+    return;
+#endif
+
+  rawChar(c);
+}
+
+/**
+ * @brief Send character to caller's stdout, bypassing any capture, by calling the call-back function given,
+ * or buffering until return (if cb_out is NULL).
+ * 
+ * @param c character to write to caller's stdout
+ */
+static void rawChar(const char c)
+{
+  if (c == '\n')
+    g_s->linesOut++;
+
+  // If given, use call-back to send character to stdout
+  if (g_cb_out)
+  {
+    g_cb_out(c);
+  } else
+  {
+    // Otherwise, buffer and return as a string of one or more characters.
+    if (g_s->outCharIdx < g_s->outSize)
+      g_s->outCharsBuf[g_s->outCharIdx++] = c;
+  }
+}
+
+/**
+ * @brief Reveals if given line is "empty".
+ * Line is considered empty if it has no string to try to process.
+ * 
+ * @param line line string to check
+ * @return true if line has no command to process, i.e., is "empty"
+ */
+static bool isEmptyLine(const char * line)
+{
+  int len = strlen(line);
+  int i;
+  for (i=0;i<len;i++)
+    if ((line[i] != '\r') && (line[i] != '\n') && (line[i] != ' '))
+      return false;
+  return true;
+}
+
+#if UP_FEATURE_TAB
+/**
+ * @brief Look for a partial (or full) match of the given string to exactly
+ * one registered handler command. (FUTURE - also do constant string parameters?)
+ * 
+ * @param str partial line to match
+ * @return index of handler structure whose command string at least partially matches, -1 if no or multiple matches
+ */
+static int uniquePartialMatch(const char * str)
+{
+  int len = strlen(str);
+  int midx = -1;
+  int i;
+  for (i=0;i<g_s->reg->numCmds;i++)
+  {
+    if (strncmp(str, g_s->reg->cmd[i].cmd, len) == 0)
+    {
+      if (midx != -1)
+        return -1;  // multiple matches
+      midx = i;
+    }
+  }
+
+  // Return index found, or -1 if none.
+  return midx;
+}
+#endif
+
+/**
+ * @brief Build-in default handler when no other handler found in command table.
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_unhandled(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  (void)param;
+  (void)numParams;
+  g_status = UP_STATUS_UNKNOWN;
+  uP_printf("*** Huh? ***%s", g_s->outLineEnd);
+#if UP_FEATURE_SUGGEST
+  suggestCommands(cmd);
+#endif
+}
+
+#if UP_FEATURE_SUGGEST
+/**
+ * @brief Suggest up to three registered commands close to an unknown one, closest first, as:
+ *   Did you mean: status, stats
+ * Closeness is edit distance (characters inserted, deleted or changed), up to about a third of the command's length.
+ * 
+ * @param cmd unknown command
+ */
+static void suggestCommands(const char * cmd)
+{
+  uint32_t peq[128];    // for each character, bit i set if cmd[i] is that character
+  int best[3];          // closest commands so far, closest first
+  int bestDist[3];
+  int numBest = 0;
+  int m = strlen(cmd);
+  int i;
+  int j;
+
+  // Commands longer than a word can't be matched a word at a time - and are unlikely to be typos of a command anyway.
+  if ((m == 0) || (m > 32))
+    return;
+  memset(peq, 0, sizeof(peq));
+  for (i=0;i<m;i++)
+    peq[cmd[i] & 0x7F] |= (uint32_t)1 << i;
+  int maxDist = (m + 2) / 3;
+
+  for (i=0;i<g_s->reg->numCmds;i++)
+  {
+    const char * cand = g_s->reg->cmd[i].cmd;
+    int n = strlen(cand);
+
+    // Lengths alone rule out most commands. Beyond that, only distances that would make the list are of interest.
+    int limit = (numBest < 3) ? maxDist : (bestDist[2] - 1);
+    if ((n - m > limit) || (m - n > limit))
+      continue;
+    int d = editDistance(peq, m, cand, limit);
+    if (d > limit)
+      continue;
+
+    // Insert in order, dropping the furthest if full.
+    for (j=(numBest < 3) ? numBest++ : 2;(j > 0) && (bestDist[j-1] > d);j--)
+    {
+      best[j] = best[j-1];
+      bestDist[j] = bestDist[j-1];
+    }
+    best[j] = i;
+    bestDist[j] = d;
+  }
+
+  if (numBest == 0)
+    return;
+  uP_printf("Did you mean: ");
+  for (j=0;j<numBest;j++)
+    uP_printf("%s%s", (j > 0) ? ", " : "", g_s->reg->cmd[best[j]].cmd);
+  uP_printf("%s", g_s->outLineEnd);
+}
+
+/**
+ * @brief Edit distance (Levenshtein) between a pattern of up to 32 characters and a text, using the bit-parallel algorithm of
+ * Myers (as adapted by Hyyro for whole-string distance): each column of the distance matrix is held as bit vectors of
+ * vertical deltas, so each character of text costs a handful of word operations, whatever the pattern length.
+ * 
+ * @param peq pattern match vectors: bit i of peq[c] set if pattern character i is c
+ * @param m pattern length, 1 to 32
+ * @param text text to compare against
+ * @param maxDist distance beyond which the exact value is of no interest
+ * @return int edit distance, or some value over maxDist if the distance exceeds maxDist
+ */
+static int editDistance(const uint32_t * peq, int m, const char * text, int maxDist)
+{
+  uint32_t mask = (m == 32) ? 0xFFFFFFFFu : (((uint32_t)1 << m) - 1);
+  uint32_t high = (uint32_t)1 << (m - 1);
+  uint32_t pv = mask;   // vertical deltas of +1
+  uint32_t mv = 0;      // vertical deltas of -1
+  int score = m;        // distance from the whole pattern to the text so far
+  int left = strlen(text);
+
+  for (;*text != '\0';text++)
+  {
+    uint32_t eq = peq[*text & 0x7F];
+    uint32_t xv = eq | mv;
+    uint32_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint32_t ph = mv | ~(xh | pv);
+    uint32_t mh = pv & xh;
+
+    if (ph & high)
+      score++;
+    else if (mh & high)
+      score--;
+
+    // Early cutoff: the score can fall by at most one per character left.
+    left--;
+    if (score - left > maxDist)
+      return maxDist + 1;
+
+    ph = (ph << 1) | 1;   // top row of the matrix counts up, for distance to the whole text (rather than a search within it)
+    mh <<= 1;
+    pv = (mh | ~(xv | ph)) & mask;
+    mv = ph & xv & mask;
+  }
+  return score;
+}
+#endif
+
+#if UP_FEATURE_HELP
+/**
+ * @brief Built-in handler to display help on all register commands.
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_help(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  (void)param;
+  (void)numParams;
+
+  uP_printf("%s===== Commands =====%s\n", g_s->outLineEnd, g_s->outLineEnd);
+  int i;
+  for (i=0;i<g_s->reg->numCmds; i++)
+  {
+    char const * helpText = "";
+    if (g_s->reg->cmd[i].help != NULL)
+      helpText = g_s->reg->cmd[i].help;
+    uP_printf("  \"%s\" - %s%s", g_s->reg->cmd[i].cmd, helpText, g_s->outLineEnd);
+  }
+}
+#endif
+
+#if UP_SCRIPT_FILES
+/**
+ * @brief Built-in handler to run a script of commands from a file.
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_source(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  bool stopOnError = false;
+
+  if ((numParams > 0) && (strcmp(param[0], "-e") == 0))
+  {
+    stopOnError = true;
+    param++;
+    numParams--;
+  }
+  if (!uP_confirmParameters(numParams, 1))
+    return;
+
+  uP_setStatus(runScriptFile(param[0], stopOnError));
+}
+#endif
+
+#if UP_VARIABLES
+/**
+ * @brief Hash a variable name (FNV-1a), for the index of variables.
+ * 
+ * @param name variable name
+ * @return uint32_t hash
+ */
+static uint32_t hashName(const char * name)
+{
+  uint32_t h = 2166136261u;
+  while (*name != '\0')
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+  return h;
+}
+
+/**
+ * @brief Look up a variable by name, through the hash index.
+ * 
+ * @param name variable name
+ * @return int index of variable, or -1 if not set
+ */
+static int findVariable(const char * name)
+{
+  const Variables * vs = g_s->vars;
+  uint32_t h = hashName(name);
+  int slot = h % VAR_INDEX_SIZE;
+
+  if (vs == NULL)
+    return -1;
+  while (vs->index[slot] != 0)
+  {
+    const Variable * v = &vs->var[vs->index[slot] - 1];
+    if ((v->hash == h) && (strcmp(name, &vs->text[v->name]) == 0))
+      return vs->index[slot] - 1;
+    slot = (slot + 1) % VAR_INDEX_SIZE;
+  }
+  return -1;
+}
+
+/**
+ * @brief Substitute a variable's value for a parameter naming it, as $name.
+ * 
+ * @param tok parameter, starting with '$'
+ * @return const char* value of variable, or the parameter as given if it names no variable
+ */
+static const char * variableValue(const char * tok)
+{
+  int v = findVariable(&tok[1]);
+  return (v >= 0) ? &g_s->vars->text[g_s->vars->var[v].value] : tok;
+}
+
+/**
+ * @brief Set a variable of the session, replacing any value it had. Its name and value are added to the end of the text,
+ * before any old value is deleted, since the new value may be given by variables (and so point into the text).
+ * 
+ * @param name variable name: a letter or '_', then letters, digits or '_'
+ * @param param value, in one or more parameters, joined by spaces - none for an empty value
+ * @param numParams number of parameters
+ * @return true if set, false if name not valid or out of room
+ */
+static bool setVariable(const char * name, char const * const * param, int numParams)
+{
+  Variables * vs = g_s->vars;
+  int len = strlen(name) + 1;
+  int i;
+
+  for (i=0;name[i] != '\0';i++)
+  {
+    if (!isalpha((unsigned char)name[i]) && (name[i] != '_') && ((i == 0) || !isdigit((unsigned char)name[i])))
+    {
+      uP_printf("*** Bad variable name \"%s\" ***%s", name, g_s->outLineEnd);
+      return false;
+    }
+  }
+  int old = findVariable(name);
+  for (i=0;i<numParams;i++)
+    len += strlen(param[i]) + 1;
+  if (numParams == 0)
+    len++;
+  if ((vs == NULL) || (vs->numVars >= MAX_VARIABLES + (old >= 0)) || (vs->textLen + len > vs->textSize))
+  {
+    uP_printf("*** No room for variable ***%s", g_s->outLineEnd);
+    return false;
+  }
+
+  // Copy name, then value.
+  Variable * v = &vs->var[vs->numVars];
+  char * p = &vs->text[vs->textLen];
+  v->hash = hashName(name);
+  v->name = vs->textLen;
+  strcpy(p, name);
+  p += strlen(name) + 1;
+  v->value = p - vs->text;
+  *p = '\0';
+  for (i=0;i<numParams;i++)
+  {
+    if (i > 0)
+      *p++ = ' ';
+    strcpy(p, param[i]);
+    p += strlen(param[i]);
+  }
+  vs->textLen = p + 1 - vs->text;
+  vs->numVars++;
+  if (old >= 0)
+    deleteVariable(old);
+  else
+    indexVariables();
+  return true;
+}
+
+/**
+ * @brief Delete a variable, closing up the text of those set after it.
+ * 
+ * @param v index of variable
+ */
+static void deleteVariable(int v)
+{
+  Variables * vs = g_s->vars;
+  int textEnd = (v+1 < vs->numVars) ? vs->var[v+1].name : vs->textLen;
+  int textLen = textEnd - vs->var[v].name;
+  int i;
+
+  memmove(&vs->text[vs->var[v].name], &vs->text[textEnd], vs->textLen - textEnd);
+  vs->textLen -= textLen;
+  memmove(&vs->var[v], &vs->var[v+1], (vs->numVars - v - 1) * sizeof(vs->var[0]));
+  vs->numVars--;
+  for (i=v;i<vs->numVars;i++)
+  {
+    vs->var[i].name -= textLen;
+    vs->var[i].value -= textLen;
+  }
+  indexVariables();
+}
+
+/**
+ * @brief Rebuild the hash index of variables, open-addressed, after variables are set or deleted. Variables are looked up
+ * far more often than they are set, so this is simpler than keeping the index up to date entry by entry.
+ * 
+ */
+static void indexVariables(void)
+{
+  Variables * vs = g_s->vars;
+  int v;
+
+  memset(vs->index, 0, sizeof(vs->index));
+  for (v=0;v<vs->numVars;v++)
+  {
+    int slot = vs->var[v].hash % VAR_INDEX_SIZE;
+    while (vs->index[slot] != 0)
+      slot = (slot + 1) % VAR_INDEX_SIZE;
+    vs->index[slot] = v + 1;
+  }
+}
+
+/**
+ * @brief Built-in handler to set or show variables, given to commands as $name, as
+ *   set addr 0x4000; read $addr 16
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_set(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  const Variables * vs = g_s->vars;
+  int v;
+
+  // No parameters: show all.
+  if (numParams == 0)
+  {
+    for (v=0;(vs != NULL) && (v < vs->numVars);v++)
+      uP_printf("set %s \"%s\"%s", &vs->text[vs->var[v].name], &vs->text[vs->var[v].value], g_s->outLineEnd);
+    return;
+  }
+
+  // Name only: show that one.
+  if (numParams == 1)
+  {
+    if ((v = findVariable(param[0])) >= 0)
+      uP_printf("%s%s", &vs->text[vs->var[v].value], g_s->outLineEnd);
+    else
+    {
+      uP_printf("*** No variable \"%s\" ***%s", param[0], g_s->outLineEnd);
+      uP_setStatus(UP_STATUS_FAILED);
+    }
+    return;
+  }
+
+  if (!setVariable(param[0], &param[1], numParams-1))
+    uP_setStatus(UP_STATUS_FAILED);
+}
+
+/**
+ * @brief Built-in handler to delete variables.
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_unset(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  int i;
+  int v;
+
+  if (!uP_confirmParameters(numParams, 1))
+    return;
+  for (i=0;i<numParams;i++)
+    if ((v = findVariable(param[i])) >= 0)
+      deleteVariable(v);
+}
+#endif
+
+#if UP_ALIASES
+/**
+ * @brief Look up an alias by name.
+ * 
+ * @param name alias name
+ * @return int index of alias, or -1 if none
+ */
+static int findAlias(const char * name)
+{
+  int a;
+  for (a=0;a<g_numAliases;a++)
+    if (strcmp(name, &g_aliasText[g_alias[a].name]) == 0)
+      return a;
+  return -1;
+}
+
+/**
+ * @brief Run the commands of an alias, in place of the alias given as a command. The commands were split into tokens when
+ * the alias was defined, so each is run by splicing its tokens with the parameters given, with no copy or parse of text.
+ * Parameters given replace $1..$9, if the alias uses them, otherwise they follow its last command. A command may itself be
+ * an alias, nested up to MAX_ALIAS_DEPTH deep.
+ * 
+ * @param a index of alias
+ * @param tok alias name followed by the parameters given
+ * @param numTok number of tokens, at least one
+ * @return true if every command recognized and handled
+ */
+static bool expandAlias(int a, char const * const * tok, int numTok)
+{
+  const Alias * al = &g_alias[a];
+  char const * cmdTok[MAX_PARAMETERS+1];
+  int n = 0;
+  bool handled = true;
+  int status = UP_STATUS_OK;
+  int t;
+  int k;
+
+  // Guard against an alias that uses itself, directly or otherwise.
+  if (g_aliasDepth >= MAX_ALIAS_DEPTH)
+  {
+    g_aliasTooDeep++;
+    uP_printf("*** Aliases nested too deep ***%s", g_s->outLineEnd);
+    g_status = UP_STATUS_FAILED;
+    return false;
+  }
+  g_aliasDepth++;
+  g_aliasExpansions++;
+  if (g_aliasDepth > g_aliasMaxDepth)
+    g_aliasMaxDepth = g_aliasDepth;
+
+  for (t=al->firstTok;t<al->firstTok+al->numTok;t++)
+  {
+    // Gather the tokens of a command, substituting parameters given for $1..$9, and leaving out any not given.
+    if (g_aliasTok[t] != ALIAS_END)
+    {
+      const char * str = &g_aliasText[g_aliasTok[t]];
+      if (al->params && (str[0] == '$') && (str[1] >= '1') && (str[1] <= '9') && (str[2] == '\0'))
+      {
+        k = str[1] - '0';
+        if (k >= numTok)
+          continue;
+        str = tok[k];
+      }
+#if UP_VARIABLES
+      else if ((str[0] == '$') && (n > 0))
+        str = variableValue(str);
+#endif
+      if (n < (int)NUM_ELEMENTS(cmdTok))
+        cmdTok[n++] = str;
+      continue;
+    }
+
+    // End of command: parameters given follow the last, unless placed by $1..$9.
+    if (!al->params && (t == al->firstTok + al->numTok - 1))
+      for (k=1;(k < numTok) && (n < (int)NUM_ELEMENTS(cmdTok));k++)
+        cmdTok[n++] = tok[k];
+    if (n == 0)
+      continue;
+    bool ok = dispatch(findCommand(cmdTok[0]), cmdTok, n);
+    handled = handled && ok;
+    if (status == UP_STATUS_OK)
+      status = g_status;
+    n = 0;
+  }
+
+  g_aliasDepth--;
+  g_status = status;
+  return handled;
+}
 
-bool uP_RegisterHandler(const char * cmd, void (*handler)(char const * const cmd, char const * const * param, int numParams), const char * help, char const * const * hints)
+/**
+ * @brief Define an alias, replacing any of the same name. Its commands are joined into g_aliasText[] after the name, then split
+ * into tokens there, once and for all. A replaced definition is lost even if the new one doesn't fit.
+ * 
+ * @param name alias name
+ * @param param commands, separated by ';', in one or more parameters
+ * @param numParams number of parameters, at least one
+ * @return true if defined, false if out of room
+ */
+static bool defineAlias(const char * name, char const * const * param, int numParams)
 {
-  // Fail-safe: check for max. Ignore and retun failure if full.
-  if (g_numRegCmds >= MAX_COMMANDS)
-    return false;
+  int len = strlen(name) + 1;
+  int i;
 
-  // Fail-safe: ignore and return failure if handler pointer is null.
-  if (handler == NULL)
+  if ((i = findAlias(name)) >= 0)
+    deleteAlias(i);
+  for (i=0;i<numParams;i++)
+    len += strlen(param[i]) + 1;
+  if ((g_numAliases >= MAX_ALIASES) || (g_aliasTextLen + len > (int)sizeof(g_aliasText)))
+  {
+    uP_printf("*** No room for alias ***%s", g_s->outLineEnd);
     return false;
+  }
 
-  // If first time called, then initialize list to include a "help" handler.
-  if (!g_helpInitialized)
+  // Copy name, then commands, joined by spaces.
+  Alias * al = &g_alias[g_numAliases];
+  char * p = &g_aliasText[g_aliasTextLen];
+  al->name = g_aliasTextLen;
+  al->firstTok = g_aliasNumTok;
+  al->numTok = 0;
+  al->params = false;
+  strcpy(p, name);
+  p += strlen(name) + 1;
+  char * line = p;
+  for (i=0;i<numParams;i++)
   {
-    // Recursively call this to register the standard help handler. Flag initialized _first_ to avoid infinite recursion!
-    g_helpInitialized = true;
-    uP_RegisterHandler("help", handle_help, "this help message", NULL);
+    strcpy(p, param[i]);
+    p += strlen(param[i]);
+    *p++ = ' ';
   }
+  p[-1] = '\0';
 
-  g_cmd[g_numRegCmds].cmd = cmd;
-  g_cmd[g_numRegCmds].handler = handler;
-  g_cmd[g_numRegCmds].help = help;
-  g_cmd[g_numRegCmds].hints = hints;
+  // Split commands into tokens, in place, noting where each token is, and where each command ends.
+  while (line != NULL)
+  {
+    char const * tok[MAX_PARAMETERS+1];
+    int numTok;
+    line = tokenize(line, tok, NUM_ELEMENTS(tok), &numTok, false);
+    if (numTok == 0)
+      continue;
+    if (g_aliasNumTok + al->numTok + numTok + 1 > (int)NUM_ELEMENTS(g_aliasTok))
+    {
+      uP_printf("*** No room for alias ***%s", g_s->outLineEnd);
+      return false;
+    }
+    for (i=0;i<numTok;i++)
+    {
+      g_aliasTok[al->firstTok + al->numTok++] = tok[i] - g_aliasText;
+      if ((tok[i][0] == '$') && (tok[i][1] >= '1') && (tok[i][1] <= '9') && (tok[i][2] == '\0'))
+        al->params = true;
+    }
+    g_aliasTok[al->firstTok + al->numTok++] = ALIAS_END;
+  }
+  if (al->numTok == 0)
+  {
+    uP_printf("*** No commands given ***%s", g_s->outLineEnd);
+    return false;
+  }
 
-  // Count commands, and return success.
-  g_numRegCmds++;
+  g_numAliases++;
+  g_aliasNumTok += al->numTok;
+  g_aliasTextLen = p - g_aliasText;
   return true;
 }
 
 /**
- * @brief Call with each character received from an input stream, one character per call.
- * Recognizes and processes commands with parameters (based on handlers registered), with each line ending with one or more line-end characters.
- * Recognizes and handles backspace characters and escape sequences.
- * Uses cb_out call-back to echo received, and process backspace and escape sequences.
+ * @brief Delete an alias, closing up the text and tokens of those defined after it.
  * 
- * @param c ASCIIZ character that is next in stdin stream of characters to process
- * @param cb_out call-back to stdout stream - putchar works nicely, if available
- * @return char* ASCIIZ string received, or empty string if complete string and line-end not received yet
+ * @param a index of alias
  */
-char * uP_ProcessChar(const char c, int (*cb_out)(int c))
+static void deleteAlias(int a)
 {
-  const char kUpArrowEscape[] = "\x1B\x5b\x41";
-  const char kDownArrowEscape[] = "\x1B\x5b\x42";
-  const char kRightArrowEscape[] = "\x1B\x5b\x43";
-  const char kLeftArrowEscape[] = "\x1B\x5b\x44";
-  const char kF3Escape[] = "\x1B\x4F\x52";
-  static char escapeChars[3] = { 0 };
-  static int recallIdx = -1;
+  int textEnd = (a+1 < g_numAliases) ? g_alias[a+1].name : g_aliasTextLen;
+  int textLen = textEnd - g_alias[a].name;
+  int firstTok = g_alias[a].firstTok;
+  int numTok = g_alias[a].numTok;
   int i;
-  int len;
-  int extChar = 0;
-
-  // Copy pointer to character output call-back as file global, for use by other functions herein.
-  g_cb_out = (void(*)(char))cb_out;
 
-  // If not otherwise called, default our preferred line-end we write out to CRLF.
-  if (!g_lineEndSet)
+  memmove(&g_aliasText[g_alias[a].name], &g_aliasText[textEnd], g_aliasTextLen - textEnd);
+  g_aliasTextLen -= textLen;
+  memmove(&g_aliasTok[firstTok], &g_aliasTok[firstTok + numTok], (g_aliasNumTok - firstTok - numTok) * sizeof(g_aliasTok[0]));
+  g_aliasNumTok -= numTok;
+  for (i=firstTok;i<g_aliasNumTok;i++)
+    if (g_aliasTok[i] != ALIAS_END)
+      g_aliasTok[i] -= textLen;
+  memmove(&g_alias[a], &g_alias[a+1], (g_numAliases - a - 1) * sizeof(g_alias[0]));
+  g_numAliases--;
+  for (i=a;i<g_numAliases;i++)
   {
-    g_lineEndSet = true;
-    strcpy(g_outLineEnd, "\r\n");
+    g_alias[i].name -= textLen;
+    g_alias[i].firstTok -= numTok;
   }
+}
 
-  // If uP_RegisterHandler() was never called to register any user commands, then initialize it now so that at least "help" is handled.
-  // Maybe make it a special help command, to provide help on how to register commands ?
-  if (!g_helpInitialized)
+/**
+ * @brief Show an alias, as the command that would define it.
+ * 
+ * @param a index of alias
+ */
+static void showAlias(int a)
+{
+  const char * sep = "";
+  int t;
+
+  uP_printf("alias %s \"", &g_aliasText[g_alias[a].name]);
+  for (t=g_alias[a].firstTok;t<g_alias[a].firstTok+g_alias[a].numTok;t++)
   {
-    // Register the built-in help handler. Must flag as initialized first, to avoid re-adding in register call.
-    g_helpInitialized = true;
-    uP_RegisterHandler("help", handle_help, "this help message", NULL);
+    if (g_aliasTok[t] == ALIAS_END)
+    {
+      sep = "; ";
+      continue;
+    }
+    uP_printf("%s%s", sep, &g_aliasText[g_aliasTok[t]]);
+    sep = " ";
   }
+  uP_printf("\"%s", g_s->outLineEnd);
+}
 
-  // Handle ctl-C.
-  if (c == '\03')
-  {
-    // Output "^C", advance line and show prompt.
-    uP_printf("^C%s%s", g_outLineEnd, g_prompt);
+/**
+ * @brief Built-in handler to define, show or delete aliases: commands that stand for a list of other commands, as
+ *   alias rs "reset soft; status"
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_alias(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  int a;
 
-    // Reset line buffer and edit statics.
-    lineBuf[0] = '\0';
-    lineIdx = 0;
-    editIdx = -1;
-    lastChar = -1;
+  // No parameters: show all.
+  if (numParams == 0)
+  {
+    for (a=0;a<g_numAliases;a++)
+      showAlias(a);
+    return;
   }
 
-  // Catch escape sequences in incoming character stream.
-  int esc = processEscapes(c);
-  switch(esc)
+  // Name only: show that one.
+  bool del = (strcmp(param[0], "-d") == 0);
+  if ((numParams == 1) && !del)
   {
-    case ESC_PROCESSING:    // still processing an escape sequence - nothing more to do
-      return "";
-    case ESC_NO_ACTION:     // no escape sequence (and not working on one) - just process the character given
-      extChar = c;
-      break;
-    default:    // escape sequence matched, returning a non-printabbloe integer {1,2,..} - let line editor call handle it below
-      extChar = esc;
-      break;
-    case ESC_UP_ARROW:
-      // If first time since latest line, start with latest line,
-      // otherwise continue to rewind through circular history buffer.
-      i = recallIdx;
-      if (i < 0)
-        i = (MAX_HISTORY + histIdx - 1) % MAX_HISTORY;
-      else
-        i = (MAX_HISTORY + recallIdx - 1) % MAX_HISTORY;
-
-      // Nothing to do if no prior history.
-      if (histBuf[i][0] == '\0')
-        return "";
-
-      // If line to recall, recall it.
-      recallIdx = i;
-      clearLine();  // clear current
-      strcpy(lineBuf, histBuf[recallIdx]);  // set to recalled history
-      lineIdx = strlen(lineBuf);    // set index to length of string recalled
-      uP_printf(lineBuf);  // output back to stdout stream, via call-back
-      return lineBuf; // return line recalled
-    case ESC_DOWN_ARROW:
-      // Nothing to wind forward to, if we haven't recalled any history yet,
-      // otherwise, wind forward, stopping just short of current history index.
-      i = recallIdx;
-      if (i < 0)
-        return "";
-      else
-        i = (recallIdx + 1) % MAX_HISTORY;
-
-      // Nothing to do if we're up to current history index.
-      if (i == histIdx)
-        return "";
-
-      // If line to recall, recall it.
-      recallIdx = i;
-      clearLine();  // clear current
-      strcpy(lineBuf, histBuf[recallIdx]);  // set to recalled history
-      lineIdx = strlen(lineBuf);    // set index to length of string recalled
-      uP_printf(lineBuf);  // output back to stdout stream, via call-back
-      return lineBuf; // return line recalled
+    if ((a = findAlias(param[0])) >= 0)
+      showAlias(a);
+    else
+    {
+      uP_printf("*** No alias \"%s\" ***%s", param[0], g_s->outLineEnd);
+      uP_setStatus(UP_STATUS_FAILED);
+    }
+    return;
   }
 
-  // Edit line
-  if (editLine(extChar))
+  // Aliases being run point into the alias text, so leave it be until they're done.
+  if (g_aliasDepth > 0)
   {
-    /** Line-end received, command has been entered. **/
-
-    // Terminate buffer and reset the line index.
-    lineBuf[lineIdx] = '\0';  // make sure we're terminated
-    lineIdx = 0;          // reset for next command
-
-    // Reset the recall index.
-    recallIdx = -1;
+    uP_printf("*** Can't change aliases from an alias ***%s", g_s->outLineEnd);
+    uP_setStatus(UP_STATUS_FAILED);
+    return;
+  }
 
-    if (!isEmptyLine(lineBuf))
+  if (del)
+  {
+    if (!uP_confirmParameters(numParams, 2))
+      return;
+    if ((a = findAlias(param[1])) >= 0)
+      deleteAlias(a);
+    else
     {
-      // Put a line between what was just entered and whatever output the response will be, unless CR only entered.
-      uP_printf(g_outLineEnd);
-
-      // Save a copy of full line, before splitting into command and parameters.
-      char fullLine[MAX_TOTAL_COMMAND_CHARS+1];
-      strcpy(fullLine, lineBuf);
-
-      // Parse and process string received.
-      processLine(lineBuf);
-
-      // Track history, including unhandled commands, as a circular ring buffer.
-      memcpy(histBuf[histIdx], fullLine, sizeof(histBuf[0]));
-      histIdx = (histIdx + 1) % MAX_HISTORY;
+      uP_printf("*** No alias \"%s\" ***%s", param[1], g_s->outLineEnd);
+      uP_setStatus(UP_STATUS_FAILED);
     }
-
-    // Prompt
-    uP_printf("%s%s", g_outLineEnd, g_prompt);
+    return;
   }
 
-  // Return any pending output characters, otherwise return an empty string.
-  if (g_outCharIdx > 0)
+  if (findCommand(param[0]) >= 0)
   {
-    g_outCharsBuf[g_outCharIdx] = '\0';   // make sure string is null-terminated
-    g_outCharIdx = 0;                     // reset buffer index
-    return g_outCharsBuf;
-  } else
-  {
-    return "";
+    uP_printf("*** \"%s\" is already a command ***%s", param[0], g_s->outLineEnd);
+    uP_setStatus(UP_STATUS_FAILED);
+    return;
   }
+  if (!defineAlias(param[0], &param[1], numParams-1))
+    uP_setStatus(UP_STATUS_OVERFLOW);
 }
 
 /**
- * @brief Set the preferred line-end characters for stdout. Default is a single line-feed.
- * May be "\r", "\n" or "\r\n", or any string of up to two characters.
+ * @brief Report on aliases expanded.
  * 
- * @param c preferred line-end characters, max two characters
+ * @param expansions receives number of aliases expanded, counting those nested
+ * @param maxDepth receives deepest nesting of aliases expanded, 1 if none used another
+ * @param tooDeep receives number of aliases not expanded for nesting deeper than MAX_ALIAS_DEPTH
  */
-void uP_setOutLineEnd(const char * str)
+void uP_getAliasStats(unsigned long * expansions, int * maxDepth, unsigned long * tooDeep)
 {
-  memset(g_outLineEnd, 0, sizeof(g_outLineEnd));      // pre-clear string
-  strncpy(g_outLineEnd, str, sizeof(g_outLineEnd)-1); // copy up to two characters for line-end
+  if (expansions)
+    *expansions = g_aliasExpansions;
+  if (maxDepth)
+    *maxDepth = g_aliasMaxDepth;
+  if (tooDeep)
+    *tooDeep = g_aliasTooDeep;
 }
+#endif
 
+#if UP_BROADCAST
 /**
- * @brief Set a prompt string to feed back to the outgoing stream.
+ * @brief Send a line of output to every session (set up and not ended), as an alarm or notice of shutdown, in the same way
+ * as a watch: between lines typed, with the line being typed drawn again after it. The line is formatted once, and
+ * shared by each session until sent it, by uP_Poll(). Not sent to sessions in machine mode or JSON response mode.
  * 
- * @param str prompt string, as "> "
+ * @param fmt printf-style format of the line, without line end - each session adds its own
+ * @param ... arguments for the format
+ * @return int sessions the line is to be sent to, or -1 if there is no room for another broadcast
  */
-void uP_setPrompt(const char * str)
+int uP_Broadcast(const char * fmt, ...)
 {
-  memset(g_prompt, 0, sizeof(g_prompt));
-  strncpy(g_prompt, str, MAX_SHELL_PROMPT);
+  Broadcast * b = NULL;
+  uP_Session * s;
+  va_list args;
+  int i;
+
+  UP_LOCK();
+  for (i=0;(i < MAX_BROADCASTS) && (b == NULL);i++)
+    if (g_bcast[i].refs == 0)
+      b = &g_bcast[i];
+  if (b == NULL)
+  {
+    UP_UNLOCK();
+    return -1;
+  }
+
+  va_start(args, fmt);
+  b->len = vsnprintf(b->text, sizeof(b->text), fmt, args);
+  va_end(args);
+  if (b->len >= (int)sizeof(b->text))
+    b->len = sizeof(b->text) - 1;
+  if (b->len < 0)
+    b->len = 0;
+
+  // Queue a reference for each session that shows text, leaving out any whose queue is full.
+  for (s=g_sessions;s != NULL;s=s->nextSession)
+  {
+    if (s->machineMode || (s->responseMode != UP_RESPONSE_TEXT) || (s->bcastCount >= MAX_BROADCAST_QUEUE))
+      continue;
+    s->bcast[(s->bcastHead + s->bcastCount) % MAX_BROADCAST_QUEUE] = b;
+    s->bcastCount++;
+    b->refs++;
+    g_bcastQueued++;
+  }
+  i = b->refs;
+  UP_UNLOCK();
+  return i;
 }
 
 /**
- * @brief Check number of parameters, based on given criteria, show error and return false if bad.
+ * @brief Put a session in the list of those sent broadcasts, if not already.
  * 
- * @param numGivenParams the number of parameters given
- * @param numExpectedParams the number of parameters expected
- * @return true if parameters are good, false if bad
+ * @param s session
  */
-bool uP_confirmParameters(int numGivenParams, int numExpectedParams)
+static void listSession(uP_Session * s)
 {
-  if (numGivenParams < numExpectedParams)
-  {
-    uP_printf("*** You only gave me %d parameter%s, I need at least %d ***\n", numGivenParams, (numGivenParams>1)?"s":"", numExpectedParams);
-    return false;
-  }
-
-  return true;
+  if (s->listed)
+    return;
+  s->prevSession = NULL;
+  s->nextSession = g_sessions;
+  if (g_sessions)
+    g_sessions->prevSession = s;
+  g_sessions = s;
+  s->listed = true;
 }
 
 /**
- * @brief Clear the line buffer, and also clear using stdout stream call-back, if available.
+ * @brief Let go of a session's reference to a broadcast, freeing it once no session refers to it.
  * 
+ * @param b broadcast
  */
-static void clearLine(void)
+static void releaseBroadcast(Broadcast * b)
 {
-  // Wipe stream output line using call-back.
-  int i;
-  for (i=0;i<lineIdx;i++)
-    outChar(0x08);    // back to start of line
-  for (i=0;i<lineIdx;i++)
-    outChar(' ');     // clear line
-  for (i=0;i<lineIdx;i++)
-    outChar(0x08);    // back to start of line again
-
-  // Clear the line buffer and reset the index
-  memset(lineBuf, '\0', sizeof(lineBuf));
-  lineIdx = 0;
+  b->refs--;
+  g_bcastQueued--;
 }
 
 /**
- * @brief Edit current line, handling c/r, l/f, backspace, IDs for delete, left and right arrows,
- * and standard characters. Automatically handles either c/r or l/f single-character line-ends OR
- * c/r-l/f (or l/f-c/r) two-character line-ends.
- * This does not handle line history (up/down arrow), just single-line edits.
+ * @brief Send each session the broadcasts waiting in its queue, to the session's call-back. A session receiving a paste
+ * or streaming data is sent them later, as for a watch.
  * 
- * @param extChar extended character, including printables as well as escape sequence IDs {1,2..}, c/r, l/f, backspace and delete
- * @return true if line has just been completed by line-end character
  */
-static bool editLine(int extChar)
+static void sendBroadcasts(void)
 {
-  bool rcode = false;
-  int i;
-
-  // If first edit of line, set edit index to end of line.
-  // If new line, make sure line buffer is empty.
-  if (editIdx < 0)
-  {
-    editIdx = lineIdx;
-    if (lineIdx == 0)
-      lineBuf[0] = '\0';
-  }
+  Output prev;
+  uP_Session * s;
 
-  // Handle backspace character (0x08) or single-character del (0x7F).
-  if ((extChar == 0x7F) || (extChar == 0x08))
+  if (g_bcastQueued == 0)
+    return;
+  for (s=g_sessions;s != NULL;s=s->nextSession)
   {
-    if (editIdx > 0)
+    if ((s->bcastCount == 0) || s->pasting || s->bursting || (s->deferIdx >= 0) || (s->streamIdx >= 0))
+      continue;
+    selectOutput(s, &prev);
+    beginAsyncOutput();
+    while (s->bcastCount > 0)
     {
-      // Adjust line buffer.
-      editIdx--;
-      removeCharAtIndex(lineBuf, editIdx);
-
-      // Adjust output to terminal.
-      uP_printf("\x08%s \x08", &lineBuf[editIdx]);   // for output, back-track and rewrite everything after the backspace
-      lineIdx--;  // adjust to indicate the shorter line
-      for (i=editIdx;i<lineIdx;i++)
-        outChar('\x08');  // move output cursor from end of line back to back-spaced location
+      Broadcast * b = s->bcast[s->bcastHead];
+      if (!s->machineMode && (s->responseMode == UP_RESPONSE_TEXT))
+      {
+        outStr(b->text, b->len);
+        uP_printf("%s", s->outLineEnd);
+      }
+      releaseBroadcast(b);
+      s->bcastHead = (s->bcastHead + 1) % MAX_BROADCAST_QUEUE;
+      s->bcastCount--;
     }
+    endAsyncOutput();
+    restoreOutput(&prev);
   }
+}
+#endif
 
-  // Handle delete.
-  else if (extChar == ESC_DEL)
-  {
-    // Adjust line buffer.
-    if (removeCharAtIndex(lineBuf, editIdx))
-    {
-      // Adjust output to terminal.
-      uP_printf("%s ", &lineBuf[editIdx]);
-      for (i=editIdx;i<lineIdx;i++)
-        outChar('\x08');  // move output cursor from end of line back to back-spaced location
-      lineIdx--;  // adjust to indicate the shorter line
-    }
-  }
+#if UP_TIMERS
+/**
+ * @brief Start a timer, to call its fire() function once, after the given time. Restarts it if already running.
+ * Started from within fire(), the time is counted from when the timer was due, so a periodic timer doesn't drift.
+ * 
+ * @param t timer
+ * @param ms time from now, rounded up to a whole number of ticks (at least one)
+ */
+static void startTimer(Timer * t, unsigned long ms)
+{
+  unsigned long ticks = (ms + UP_TICK_MS - 1) / UP_TICK_MS;
 
-  // Handle left arrow.
-  else if ((extChar == ESC_LEFT_ARROW) && (editIdx > 0))
-  {
-    outChar('\x08');
-    editIdx--;
-  }
+  stopTimer(t);
+  t->expires = g_wheelTick + ((ticks > 0) ? ticks : 1);
+  insertTimer(t);
+}
 
-  // Handle right arrow.
-  else if ((extChar == ESC_RIGHT_ARROW) && (editIdx < lineIdx))
-  {
-    outChar(lineBuf[editIdx]);
-    editIdx++;
-  }
+/**
+ * @brief Stop a timer, if running.
+ * 
+ * @param t timer
+ */
+static void stopTimer(Timer * t)
+{
+  if (t->slot == 0)
+    return;
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    g_wheel[t->slot - 1] = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->slot = 0;
+}
 
-  // Handle home key.
-  else if (extChar == ESC_HOME)
-  {
-    while(editIdx > 0)
-    {
-      outChar('\x08');
-      editIdx--;
-    }
-  }
+/**
+ * @brief Put a timer in the slot of the wheel for when it is due: in level 0 if due within WHEEL_SLOTS ticks, otherwise in
+ * the level whose span of ticks it falls in.
+ * 
+ * @param t timer, not in any slot
+ */
+static void insertTimer(Timer * t)
+{
+  unsigned long delta = t->expires - g_wheelTick;
+  int level = 0;
+  int slot;
+
+  while ((level < WHEEL_LEVELS-1) && (delta >= (1ul << (WHEEL_BITS * (level+1)))))
+    level++;
+  slot = level * WHEEL_SLOTS + ((t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1));
+  t->slot = slot + 1;
+  t->prev = NULL;
+  t->next = g_wheel[slot];
+  if (t->next)
+    t->next->prev = t;
+  g_wheel[slot] = t;
+}
+
+/**
+ * @brief Move the timers of one slot of a level of the wheel down to the levels below, as the slot's span of ticks comes round.
+ * 
+ * @param level level of the wheel, from 1
+ * @param idx index of slot in level
+ */
+static void cascadeTimers(int level, int idx)
+{
+  int slot = level * WHEEL_SLOTS + idx;
+  Timer * t = g_wheel[slot];
 
-  // Handle end key.
-  else if (extChar == ESC_END)
+  g_wheel[slot] = NULL;
+  while (t)
   {
-    while (editIdx < lineIdx)
-    {
-      outChar(lineBuf[editIdx]);
-      editIdx++;
-    }
+    Timer * next = t->next;
+    insertTimer(t);
+    t = next;
   }
+}
 
-  // Handle tab, if editing at end of line.
-  else if ((extChar == ESC_TAB) && (editIdx == lineIdx))
+/**
+ * @brief Advance the wheel to the time given, a tick at a time, calling the fire() function of each timer as it falls due.
+ * 
+ * @param ms current time in milliseconds
+ */
+static void runTimers(unsigned long ms)
+{
+  // The first time, take up the clock, moving any timers already started to match.
+  if (!g_wheelStarted)
   {
-    int idx = uniquePartialMatch(lineBuf);
-    if (idx >= 0)
+    Timer * started = NULL;
+    Timer * t;
+    int slot;
+    for (slot=0;slot<WHEEL_LEVELS * WHEEL_SLOTS;slot++)
     {
-      // Characters given so far uniquely identify a known command - complete it.
-      int len = strlen(g_cmd[idx].cmd);
-      while(editIdx < len)
+      while ((t = g_wheel[slot]) != NULL)
       {
-        lineBuf[lineIdx] = g_cmd[idx].cmd[lineIdx];
-        outChar(lineBuf[editIdx]);
-        editIdx++;
-        lineIdx++;
+        stopTimer(t);
+        t->next = started;
+        started = t;
       }
     }
-  }
-
-  // (FUTURE) handle ctrl-right, ctrl-left to skip words
-
-  // Handle standard (printable) characters.
-  else if ((extChar >= ' ') && (extChar <= '~'))
-  {
-    // Append or insert character in line buffer, depending on location of edit index.
-    if (insertCharAtIndex(lineBuf, editIdx, extChar, sizeof(lineBuf)))
+    g_wheelBase = ms / UP_TICK_MS;
+    g_wheelTick = g_wheelBase;
+    g_wheelMs = ms;
+    while ((t = started) != NULL)
     {
-      // Adjust output to terminal.
-      outChar(extChar);
-      editIdx++;
-      uP_printf("%s", &lineBuf[editIdx]);
-      lineIdx++;  // adjust to indicate longer line
-      for (i=editIdx;i<lineIdx;i++)
-        outChar('\x08');  // move output cursor from end of line back to back-spaced location
+      started = t->next;
+      t->expires += g_wheelBase;
+      insertTimer(t);
     }
-  }
-  
-  // Handle c/r.
-  else if (extChar == '\r')
-  {
-    // c/r indicates line complete UNLESS it immediately follows a l/f, in which case we
-    // assume that we're being sent two-character line-ends (l/f-c/r) (is that even a thing?).
-    rcode = lastChar != '\n';
-  }
-
-  // Handle l/f.
-  else if (extChar == '\n')
-  {
-    // l/f indicates line complete UNLESS it immediately follows a c/r, in which case we
-    // assume that we're being sent two-character line-ends (c/r-l/f).
-    rcode = lastChar != '\r';
+    g_wheelStarted = true;
   }
 
-  // Ignore anything else.
-  else
+  while ((ms - g_wheelMs) >= UP_TICK_MS)
   {
-    return false;
-  }
+    g_wheelMs += UP_TICK_MS;
+    g_wheelTick++;
 
-  // Track latest character, so we can differentiate c/r-l/f line ends from an extra blank line.
-  lastChar = extChar;
+    // Cascade each level whose span comes round with this tick, from the top down.
+    int level;
+    for (level=1;level<WHEEL_LEVELS;level++)
+      if ((g_wheelTick & ((1ul << (WHEEL_BITS * level)) - 1)) != 0)
+        break;
+    while (--level >= 1)
+      cascadeTimers(level, (g_wheelTick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1));
 
-  // Reset edit index on end of line.
-  if (rcode)
-  {
-    editIdx = -1;
-    lastChar = -1;
+    // Fire the timers due, one at a time, since each may start or stop others.
+    int slot = g_wheelTick & (WHEEL_SLOTS-1);
+    while (g_wheel[slot])
+    {
+      Timer * t = g_wheel[slot];
+      stopTimer(t);
+      t->fire(t->arg);
+    }
   }
-
-  // Return that line has not yet been ended.
-  return rcode;
 }
+#endif
 
+#if UP_TIMERS || UP_BROADCAST
 /**
- * @brief Remove character at index in line, shrinking line accordingly.
- * Only allows removing at a valid character index in the line.
+ * @brief Switch to a session, with output to its call-back (not captured), as for a watch or broadcast. See restoreOutput().
  * 
- * @param line ASCIIZ line string
- * @param idx index of character to remove
+ * @param s session
+ * @param prev receives the session and output switched from
  */
-static bool removeCharAtIndex(char * line, int idx)
+static void selectOutput(uP_Session * s, Output * prev)
 {
-  int len = strlen(line);
-
-  // Return failure to shrink line if index invalid or at length of line.
-  if ((idx < 0) || (idx >= len))
-    return false;
-
-  int i;
-  for (i=idx;i<len;i++)
-    line[i] = line[i+1];
-
-  return true;
+  prev->s = g_s;
+  prev->cb_out = g_cb_out;
+  prev->sink = g_sink;
+  g_s = s;
+  g_cb_out = s->cb_out;
+  g_sink = NULL;
 }
 
 /**
- * @brief Insert character before index in line, extending line accordingly.
- * Only allows inserting from start of line (prepend) to end of line (append).
- * Will not allow line to grow beyond line buffer size given.
+ * @brief Switch back to the session and output in use before selectOutput().
  * 
- * @param line ASCIIZ line string
- * @param idx index of character before which to add the given character
- * @param c character to insert
- * @param lineSize size of line buffer, including one for null-terminator (sizeof(line))
- * @return true if character successfully inserted in the line buffer
+ * @param prev session and output switched from
  */
-static bool insertCharAtIndex(char * line, int idx, char c, int lineSize)
+static void restoreOutput(const Output * prev)
 {
-  int len = strlen(line);
-
-  // Fail-safe: index must be within, or at end, of line.
-  if ((idx < 0) || (idx > len))
-    return false;
+  g_sink = prev->sink;
+  g_cb_out = prev->cb_out;
+  g_s = prev->s;
+}
 
-  // Fail-safe: can not insert a character into a line already at maximum length.
-  if ((len+1) >= lineSize)
-    return false;
+/**
+ * @brief Prepare to write output other than in response to input, as for a watch or broadcast: erase the prompt and line being typed,
+ * so the output appears in their place. See endAsyncOutput().
+ * 
+ */
+static void beginAsyncOutput(void)
+{
+  if (g_s->machineMode || (g_s->responseMode != UP_RESPONSE_TEXT))
+    return;
+  outStr("\r\x1B[K", 4);
+  g_s->ghostShown = false;
+}
 
+/**
+ * @brief Finish output begun with beginAsyncOutput(), drawing the prompt and line again, with the cursor where it was.
+ * 
+ */
+static void endAsyncOutput(void)
+{
   int i;
-  for (i=len;i>=idx;i--)
-    line[i+1] = line[i];
-  line[idx] = c;
 
-  // Successful insert
-  return true;
+  if (g_s->machineMode || (g_s->responseMode != UP_RESPONSE_TEXT))
+    return;
+  uP_printf("%s", g_s->prompt);
+  outStr(g_s->lineBuf, g_s->lineIdx);
+  for (i=(g_s->editIdx >= 0) ? g_s->editIdx : g_s->lineIdx;i<g_s->lineIdx;i++)
+    outChar('\x08');
+}
+#endif
+
+#if UP_IDLE_TIMEOUTS
+/**
+ * @brief End the selected session after a time without input, calling the given function once it has ended, as to close
+ * the connection and free the session's memory. Optionally, warn the terminal a while before. Any input puts the end off.
+ * Timed by uP_Poll(), which must be called regularly, as for watches.
+ * 
+ * @param ms time without input after which the session ends, 0 for no limit
+ * @param warnMs time before the end to send a warning line, 0 for none
+ * @param expired function called when the session has ended, or NULL - the session is ended as by uP_EndSession(), then
+ * expired() is called by uP_Poll() after it gives up the lock (see UP_LOCK), so it may call uP_CloseSession() or other uP
+ * functions that take the lock, with no need for a recursive lock
+ */
+void uP_setIdleTimeout(unsigned long ms, unsigned long warnMs, void (*expired)(uP_Session * session))
+{
+  UP_LOCK();
+  g_s->idleMs = ms;
+  g_s->idleWarnMs = (warnMs < ms) ? warnMs : 0;
+  g_s->idleExpired = expired;
+  g_s->idleWarned = false;
+  g_s->activeTick = g_wheelTick;
+  g_s->idleTimer.fire = idleTimeout;
+  g_s->idleTimer.arg = g_s;
+  if (ms > 0)
+    startTimer(&g_s->idleTimer, ms - g_s->idleWarnMs);
+  else
+    stopTimer(&g_s->idleTimer);
+  UP_UNLOCK();
 }
 
 /**
- * @brief Parses complete string received, then identifies and processes command, with parameters.
- * This will change the line buffer passed, as it is parsed. In fact, the pointers to the command and each
- * parameter string are actually just pointers into the line string. This works for a single-threaded system,
- * as long as the command and parameter strings are used by the handler before any more characters are processed,
- * since this begins to overwrite that line again.
+ * @brief Check a session whose idle timer is due. Input only notes its tick, leaving the timer be, so typing costs nothing
+ * on the wheel: the timer falls due at the earliest the session could be idle long enough, then starts again for the time
+ * still to go, if there has been input since. Otherwise the session is warned, or ended.
  * 
- * @param line string received - modified when parsed by strtok()
- * @return true if command recognized and handled
+ * @param arg session
  */
-static bool processLine(char * line)
+static void idleTimeout(void * arg)
 {
-    char * p;
-    char * cmd;                             // command string (first parsed string)
-    char const * param[MAX_PARAMETERS];     // list of parameters parsed for command line
-    int numParams = 0;
+  uP_Session * s = (uP_Session *)arg;
 
-    // Nothing to parse if empty string, or contains only line-end characters.
-    if ((line == NULL) || (line[0] == '\0'))
-      return false;   // return no command handled
+  // Input before the wheel took up the clock counts as at the start.
+  unsigned long active = (s->activeTick > g_wheelBase) ? s->activeTick : g_wheelBase;
+  unsigned long idleMs = (g_wheelTick - active) * UP_TICK_MS;
+  unsigned long warnMs = s->idleMs - s->idleWarnMs;
 
-    // Split the copied string into command and parameters by inserting
-    // a NULL for each token, and assigning pointer to each. Note this does not
-    // add to the line passed, only replaces the token characters with NULL.
-    p = strtok(line, " ,");
-    cmd = p;
-    int i;
-    for (i=0;i<NUM_ELEMENTS(param) && p!=NULL;i++)
+  if (idleMs < warnMs)
+  {
+    s->idleWarned = false;
+    startTimer(&s->idleTimer, warnMs - idleMs);
+  } else if (idleMs < s->idleMs)
+  {
+    if ((s->idleWarnMs > 0) && !s->idleWarned && !s->machineMode)
     {
-      p = strtok(NULL, " ,");
-      if (p != NULL)
-      {
-        param[i] = p;
-        numParams++;
-      }
-    }
+      Output prev;
 
-    // Loook for match in g_cmd table, and call handler if found.
-    for (i=0;i<NUM_ELEMENTS(g_cmd);i++)
+      selectOutput(s, &prev);
+      beginAsyncOutput();
+      uP_printf("*** Idle - session ends in %lus ***%s", (s->idleMs - idleMs + 999) / 1000, s->outLineEnd);
+      endAsyncOutput();
+      restoreOutput(&prev);
+    }
+    s->idleWarned = true;
+    startTimer(&s->idleTimer, s->idleMs - idleMs);
+  } else
+  {
+    endSession(s);
+    if (s->idleExpired)
     {
-      if ((g_cmd[i].cmd != NULL) && (strcmp(cmd, g_cmd[i].cmd) == 0))
-      {
-        g_cmd[i].handler(cmd, param, numParams);
-        return true;
-      }
+      s->nextExpired = g_expired;
+      g_expired = s;
     }
-
-    // If not handled above.
-    handle_unhandled(cmd, param, numParams);
-    return false;   // return no command handled
+  }
 }
+#endif
+
+#if UP_WATCH
 
 /**
- * @brief Look for escape sequences: known strings starting with an escape character (0x1B).
- * These include up, down, left and right arrow keys, delete, and various function keys.
- * The return value indicates the state of gathering an escape sequence:
- *   -1 : processing a sequence, not complete : caller should discard the incoming character
- *    0 : no escape seuence is being gathered : caller should process the character as normal
- *   1+ : an escape sequence just recognized : caller should take action based on the return value, ignoring incoming character
- * Note thise routine does not validate the character, it only filters and reports on known escape sequences. Caller must insure
- * that any character not handled here is valid for other purposes.
- * Note that partial match may cause some incoming characters to be lost.
+ * @brief Run a watch that is due, in its session, with output to the session's call-back, then start its timer again.
+ * A watch due while its session is receiving a paste or streaming data waits for the next interval.
  * 
- * @param c next character to process
- * @return int 0 if not collecting escape characters, -1 if in process of collecting an escape sequence, or {1,2..} if recognized escape sequence
+ * @param arg watch
  */
-static int processEscapes(char c)
+static void runWatch(void * arg)
 {
-// TODO: need to handle any unrecognized escape sequences gracefully - still filter out characters that belong to ones we don't handle here!
-  // This list must match 1-based enumeration defined above.
-  // Since all strings are null-terminated, we can determine the number of used characters by looking for the null termination. Strings shorter
-  // than the alloted array size for each entry must padd with null(s).
-  const char kEscapes[][6] =
-  {
-    "\x1B\x5B\x41\x00\x00",     // up arrow
-    "\x1B\x5B\x42\x00\x00",     // down arrow
-    "\x1B\x5B\x43\x00\x00",     // right arrow
-    "\x1B\x5B\x44\x00\x00",     // left arrow
-    "\x1B\x4F\x50\x00\x00",     // F1
-    "\x1B\x4F\x51\x00\x00",     // F2
-    "\x1B\x4F\x52\x00\x00",     // F3
-    "\x1B\x4F\x53\x00\x00",     // F4
-    "\x00\x00\x00\x00\x00",     // dummy, for collisino with tab (\x09)
-    "\x1B\x5B\x31\x35\x7E",     // F5
-    "\x1B\x5B\x31\x37\x7E",     // F6
-    "\x1B\x5B\x31\x38\x7E",     // F7
-    "\x1B\x5B\x31\x39\x7E",     // F8
-    "\x1B\x5B\x32\x30\x7E",     // F9
-    "\x1B\x5B\x33\x7E\x00",     // delete
-    "\x1B\x5B\x31\x7E\x00",     // home
-    "\x1B\x5B\x34\x7E\x00",     // end
-  };
-  static char escapeChars[sizeof(kEscapes[0])] = { 0 };
+  int w = (Watch *)arg - g_watch;
+  Output prev;
+  int prevStatus = g_status;
+  char line[MAX_TOTAL_COMMAND_CHARS+1];
 
-  // Establish the next index in the escape sequence, knowing that the array
-  // will be cleared with each new escape character (0x1B).
-  int escIdx;
-  for (escIdx=0;escIdx < sizeof(escapeChars);escIdx++)
-    if (escapeChars[escIdx] == 0)
-      break;
-  
-  if (c == '\x1B')
+  startTimer(&g_watch[w].timer, g_watch[w].periodMs);
+  selectOutput(g_watch[w].session, &prev);
+  if (!g_s->pasting && !g_s->bursting && (g_s->deferIdx < 0) && (g_s->streamIdx < 0))
   {
-    // In all cases, an escape character aborts any previous sequence, so clear the escape sequence buffer.
-    memset(escapeChars, 0, sizeof(escapeChars));
-
-    if ((escIdx == 1) && (escapeChars[0] == '\x1B'))
+    strcpy(line, g_watch[w].cmd);
+    if (g_watch[w].dash >= 0)
     {
-      // If two escapes in a row (one already buffered), tell caller to process escape as a regular character,
-      // and ignore it here.
-      return ESC_NO_ACTION;
+      runDashboard(&g_dash[g_watch[w].dash], line);
     } else
     {
-      // Otherwise start buffer with it here, and tell caller that we're currently gathering a possible escape sequence.
-      escapeChars[0] = c;
-      return ESC_PROCESSING;
+      beginAsyncOutput();
+      processLine(line);
+      endAsyncOutput();
     }
   }
+  g_status = prevStatus;
+  restoreOutput(&prev);
+}
 
-  // If not an escape character (above), and no escape sequence started, then we take no action, caller should handle as regular character.
-  if (escIdx == 0)
-    return ESC_NO_ACTION;
+/**
+ * @brief Count the lines of dashboard output, checking that each can be redrawn in place: printable characters only, each
+ * line ending in a line-feed, and short enough not to wrap.
+ * 
+ * @param frame output of the command
+ * @param len characters of output
+ * @return int lines of output, or -1 if it can't be redrawn in place
+ */
+static int dashboardLines(const char * frame, int len)
+{
+  int lines = 0;
+  int col = 0;
+  int i;
 
-  // Buffer incoming. Fail-safe: insure index never exceeds buffer.
-  if (escIdx < (sizeof(escapeChars)-1))
-    escapeChars[escIdx++] = c;
+  for (i=0;i<len;i++)
+  {
+    if (frame[i] == '\n')
+    {
+      lines++;
+      col = 0;
+    } else if ((frame[i] == '\r') && (i + 1 < len) && (frame[i+1] == '\n'))
+    {
+      continue;
+    } else if ((frame[i] < ' ') || (frame[i] > '~') || (++col >= g_s->termWidth))
+    {
+      return -1;
+    }
+  }
+  return (col == 0) ? lines : -1;
+}
 
-  // Scan all known sequences for a match.
-  int eseqIdx;
-  for (eseqIdx=0;eseqIdx<NUM_ELEMENTS(kEscapes);eseqIdx++)    
+/**
+ * @brief Send part of a dashboard refresh, or just count it.
+ * 
+ * @param str characters to send
+ * @param len number of characters
+ * @param send true to send, false to count only
+ * @return int characters sent (or that would be)
+ */
+static int dashboardOut(const char * str, int len, bool send)
+{
+  if (send)
+    outStr(str, len);
+  return len;
+}
+
+/**
+ * @brief Redraw in place the characters of a dashboard that differ from those on the terminal, moving the cursor up
+ * to each line changed and across to each run of changes, then back to where it was, on the line being typed.
+ * 
+ * @param d dashboard, as on the terminal
+ * @param frame new output, with as many lines
+ * @param len characters of new output
+ * @param send true to send, false to count only
+ * @return int characters sent (or that would be)
+ */
+static int diffDashboard(const Dashboard * d, const char * frame, int len, bool send)
+{
+  const char * o = d->frame;
+  const char * n = frame;
+  char esc[16];
+  int sent = 0;
+  int up = 0;
+  int i;
+
+  for (i=0;i<d->lines;i++)
   {
-    int i;
-    for (i=0;i<escIdx;i++)
+    const char * oEnd = (const char *)memchr(o, '\n', d->frame + d->len - o);
+    const char * nEnd = (const char *)memchr(n, '\n', frame + len - n);
+    int oLen = oEnd - o;
+    int nLen = nEnd - n;
+    if ((oLen > 0) && (o[oLen-1] == '\r'))
+      oLen--;
+    if ((nLen > 0) && (n[nLen-1] == '\r'))
+      nLen--;
+
+    int col = 0;
+    while (true)
     {
-      // If match so far..
-      if (escapeChars[i] == kEscapes[eseqIdx][i])
+      // Find the next run of changes, taking in changes close enough that sending what's between costs less than a move.
+      while ((col < nLen) && (col < oLen) && (n[col] == o[col]))
+        col++;
+      int start = col;
+      int end = col;
+      for (;col<nLen;col++)
       {
-        if (kEscapes[eseqIdx][i+1] == '\x00')
-        {
-          // If last before termination, we have a match - return 1-based index.
-          memset(escapeChars, 0, sizeof(escapeChars));
-          return eseqIdx + 1;
-        }
-      } else
+        if ((col >= oLen) || (n[col] != o[col]))
+          end = col + 1;
+        else if (col - end >= DASH_GAP)
+          break;
+      }
+      bool erase = (end >= nLen) && (oLen > nLen);
+      if ((end == start) && !erase)
+        break;
+
+      // Move up to the line, saving the cursor on the way from the line being typed, then across to the change.
+      if (up != d->lines - i)
       {
-        // Mismatch, try next.
+        if (up == 0)
+          sent += dashboardOut("\x1B" "7", 2, send);
+        sent += dashboardOut(esc, sprintf(esc, "\x1B[%d%c", abs(d->lines - i - up), (up == 0) ? 'A' : 'B'), send);
+        up = d->lines - i;
+      }
+      sent += dashboardOut(esc, sprintf(esc, "\x1B[%dG", start + 1), send);
+      sent += dashboardOut(n + start, end - start, send);
+      if (erase)
+      {
+        sent += dashboardOut("\x1B[K", 3, send);
         break;
       }
     }
-
-    // All characters match so far, but more to check - return still processing.
-    if (i >= escIdx)
-      return ESC_PROCESSING;
-  }
-
-  // If failed to match any known sequence, reset and tell caller to ignore the latest character, assuming it failed on
-  // the last character - if there are more to a valid escape sequence that we don't recognize, one or more
-  // characters from the end of that sequence my be passed on as regular characters.
-  if (eseqIdx >= NUM_ELEMENTS(kEscapes))
-  {
-    memset(escapeChars, 0, sizeof(escapeChars));
-    return ESC_UNHANDLED;
-  } else
-  {
-    // Otherwise waiting on more characters to match - return "still processing".
-    return ESC_PROCESSING;
+    o = oEnd + 1;
+    n = nEnd + 1;
   }
+  if (up != 0)
+    sent += dashboardOut("\x1B" "8", 2, send);
+  return sent;
 }
 
 /**
- * @brief Uses the given call-back to feed characters back to caller's stdout, either by calling
- * given call-back function, or buffering until return (if cb_out is NULL).
+ * @brief Run the command of a dashboard watch, then send only what has changed in its output since the last run, if that
+ * is still on the terminal, just above the prompt. Otherwise the output is drawn in full, as for any other watch.
+ * Keeps count of the characters sent and saved.
  * 
- * @param c character to try to write to caller's stdout
+ * @param d dashboard
+ * @param line command line - modified when parsed
  */
-static void outChar(const char c)
+static void runDashboard(Dashboard * d, char * line)
 {
-  // If given, use call-back to send character to stdout
-  if (g_cb_out)
+  Sink sink = { g_dashBuf, sizeof(g_dashBuf), 0, false, NULL };
+
+  processLineCaptured(line, &sink);
+  int lines = sink.overflow ? -1 : dashboardLines(g_dashBuf, sink.len);
+
+  // Drawing in full costs erasing the line being typed, the output, and the prompt and line again.
+  int full = 4 + sink.len + strlen(g_s->prompt) + g_s->lineIdx;
+  if (g_s->editIdx >= 0)
+    full += g_s->lineIdx - g_s->editIdx;
+
+  // Redraw in place only if the lines are those drawn last, still on the terminal, with the line being typed not wrapped.
+  int sent = -1;
+  if (d->drawn && (lines == d->lines) && (lines > 0) && (g_s->linesOut == d->linesOut) && !g_s->machineMode &&
+    (g_s->responseMode == UP_RESPONSE_TEXT) && ((int)strlen(g_s->prompt) + g_s->lineIdx < g_s->termWidth))
   {
-    g_cb_out(c);
-  } else
+    sent = diffDashboard(d, g_dashBuf, sink.len, false);
+    if (sent < full)
+      diffDashboard(d, g_dashBuf, sink.len, true);
+    else
+      sent = -1;
+  }
+  if (sent < 0)
   {
-    // Otherwise, buffer and return as a string of one or more characters.
-    if (g_outCharIdx < MAX_STR)
-      g_outCharsBuf[g_outCharIdx++] = c;
+    beginAsyncOutput();
+    outStr(g_dashBuf, sink.len);
+    endAsyncOutput();
+    sent = full;
   }
+
+  // Keep the output to compare with the next run, if it can be redrawn in place.
+  d->drawn = (lines >= 0);
+  d->len = sink.len;
+  d->lines = lines;
+  d->linesOut = g_s->linesOut;
+  memcpy(d->frame, g_dashBuf, sink.len);
+  d->sent = sent;
+  d->saved = full - sent;
+  g_dashRefreshes++;
+  g_dashSent += d->sent;
+  g_dashSaved += d->saved;
 }
 
 /**
- * @brief Reveals if given line is "empty".
- * Line is considered empty if it has no string to try to process.
+ * @brief Get statistics of dashboards (watch -d) refreshed, over all sessions.
  * 
- * @param line line string to check
- * @return true if line has no command to process, i.e., is "empty"
+ * @param refreshes if not NULL, set to the number of refreshes
+ * @param sent if not NULL, set to the characters sent by refreshes
+ * @param saved if not NULL, set to the characters saved by refreshes, against drawing the output in full each time
  */
-static bool isEmptyLine(const char * line)
+void uP_getDashboardStats(unsigned long * refreshes, unsigned long * sent, unsigned long * saved)
 {
-  int len = strlen(line);
-  int i;
-  for (i=0;i<len;i++)
-    if ((line[i] != '\r') && (line[i] != '\n') && (line[i] != ' '))
-      return false;
-  return true;
+  if (refreshes)
+    *refreshes = g_dashRefreshes;
+  if (sent)
+    *sent = g_dashSent;
+  if (saved)
+    *saved = g_dashSaved;
 }
 
 /**
- * @brief Look for a partial (or full) match of the given string to exactly
- * one registered handler command. (FUTURE - also do constant string parameters?)
+ * @brief Built-in handler to run a command every so often, until stopped by unwatch, as
+ *   watch -n 500 status
+ * The command runs in this session, between lines typed, with the line being typed drawn again after its output.
+ * With -d, the output is drawn as a dashboard: where it is still just above the prompt, only what changed is sent.
  * 
- * @param str partial line to match
- * @return index of handler structure whose command string at least partially matches, -1 if no or multiple matches
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
  */
-static int uniquePartialMatch(const char * str)
+static void handle_watch(char const * const cmd, char const * const * param, int numParams)
 {
-  int len = strlen(str);
-  int midx = -1;
+  (void)cmd;
+  unsigned long periodMs = 2000;
+  bool dashboard = false;
+  int dash = -1;
+  int w;
   int i;
-  for (i=0;i<g_numRegCmds;i++)
+
+  // No parameters: list the watches of this session, with the characters the latest refresh of each dashboard saved.
+  if (numParams == 0)
   {
-    if (strncmp(str, g_cmd[i].cmd, len) == 0)
+    for (w=0;w<MAX_WATCHES;w++)
     {
-      if (midx != -1)
-        return -1;  // multiple matches
-      midx = i;
+      if (g_watch[w].session != g_s)
+        continue;
+      uP_printf("%d: every %lums", w + 1, g_watch[w].periodMs);
+      if (g_watch[w].dash >= 0)
+        uP_printf(", dashboard (%lu bytes sent, %lu saved)", g_dash[g_watch[w].dash].sent, g_dash[g_watch[w].dash].saved);
+      uP_printf(": %s%s", g_watch[w].cmd, g_s->outLineEnd);
     }
+    return;
   }
 
-  // Return index found, or -1 if none.
-  return midx;
+  while (numParams >= 1)
+  {
+    if (strcmp(param[0], "-d") == 0)
+    {
+      dashboard = true;
+    } else if ((numParams >= 2) && (strcmp(param[0], "-n") == 0))
+    {
+      periodMs = strtoul(param[1], NULL, 0);
+      param++;
+      numParams--;
+    } else
+    {
+      break;
+    }
+    param++;
+    numParams--;
+  }
+  if (!uP_confirmParameters(numParams, 1))
+    return;
+  if (periodMs < UP_TICK_MS)
+    periodMs = UP_TICK_MS;
+
+  for (w=0;(w < MAX_WATCHES) && (g_watch[w].session != NULL);w++)
+    ;
+  int len = numParams - 1;
+  for (i=0;i<numParams;i++)
+    len += strlen(param[i]);
+  if (dashboard)
+    for (dash=0;(dash < MAX_DASHBOARDS) && g_dash[dash].inUse;dash++)
+      ;
+  if ((w >= MAX_WATCHES) || (len >= (int)sizeof(g_watch[w].cmd)) || (dash >= MAX_DASHBOARDS))
+  {
+    uP_printf("*** No room for watch ***%s", g_s->outLineEnd);
+    uP_setStatus(UP_STATUS_OVERFLOW);
+    return;
+  }
+  if (dashboard)
+  {
+    g_dash[dash].inUse = true;
+    g_dash[dash].drawn = false;
+    g_dash[dash].sent = 0;
+    g_dash[dash].saved = 0;
+  }
+
+  // Keep the command, its parameters joined by spaces, and run it at the next tick.
+  g_watch[w].session = g_s;
+  g_watch[w].periodMs = periodMs;
+  g_watch[w].dash = dash;
+  g_watch[w].cmd[0] = '\0';
+  for (i=0;i<numParams;i++)
+  {
+    if (i > 0)
+      strcat(g_watch[w].cmd, " ");
+    strcat(g_watch[w].cmd, param[i]);
+  }
+  g_watch[w].timer.fire = runWatch;
+  g_watch[w].timer.arg = &g_watch[w];
+  startTimer(&g_watch[w].timer, 0);
+  uP_printf("Watch %d started%s", w + 1, g_s->outLineEnd);
 }
 
 /**
- * @brief Build-in default handler when no other handler found in command table.
+ * @brief Built-in handler to stop watches.
  * 
  * @param cmd command string
  * @param param list of pointers to parameter strings - use as param[0], param[1] ...
  * @param numParams number of parameters parsed for this command
  */
-static void handle_unhandled(char const * const cmd, char const * const * param, int numParams)
+static void handle_unwatch(char const * const cmd, char const * const * param, int numParams)
 {
   (void)cmd;
-  (void)param;
-  (void)numParams;
-  uP_printf("*** Huh? ***%s", g_outLineEnd);
+  int w;
+  int i;
+
+  for (w=0;w<MAX_WATCHES;w++)
+  {
+    if (g_watch[w].session != g_s)
+      continue;
+    bool stop = (numParams == 0);
+    for (i=0;i<numParams;i++)
+      if (atoi(param[i]) == w + 1)
+        stop = true;
+    if (stop)
+      stopWatch(w);
+  }
 }
 
 /**
- * @brief Built-in handler to display help on all register commands.
+ * @brief Stop a watch, freeing it and any dashboard it has.
+ * 
+ * @param w index of watch
+ */
+static void stopWatch(int w)
+{
+  stopTimer(&g_watch[w].timer);
+  if (g_watch[w].dash >= 0)
+    g_dash[g_watch[w].dash].inUse = false;
+  g_watch[w].session = NULL;
+}
+#endif
+
+#if UP_COMPILED_SCRIPTS
+/**
+ * @brief Built-in handler to compile and run a script given as a single (quoted) parameter, with statements separated by ';'.
  * 
  * @param cmd command string
  * @param param list of pointers to parameter strings - use as param[0], param[1] ...
  * @param numParams number of parameters parsed for this command
  */
-static void handle_help(char const * const cmd, char const * const * param, int numParams)
+static void handle_run(char const * const cmd, char const * const * param, int numParams)
 {
+  static uP_Program prog;
+  static bool running = false;
   (void)cmd;
-  (void)param;
-  (void)numParams;
 
-  uP_printf("%s===== Commands =====%s\n", g_outLineEnd, g_outLineEnd);
-  int i;
-  for (i=0;i<g_numRegCmds; i++)
+  if (!uP_confirmParameters(numParams, 1))
+    return;
+
+  // There's only the one program to run, so a program can't run another.
+  if (running)
   {
-    char const * helpText = "";
-    if (g_cmd[i].help != NULL)
-      helpText = g_cmd[i].help;
-    uP_printf("  \"%s\" - %s%s", g_cmd[i].cmd, helpText, g_outLineEnd);
+    uP_printf("*** Already running ***%s", g_s->outLineEnd);
+    uP_setStatus(UP_STATUS_FAILED);
+    return;
+  }
+
+  int status = compileScript(param[0], strlen(param[0]), &prog);
+  if (status != UP_STATUS_OK)
+  {
+    uP_setStatus(status);
+    return;
   }
+  running = true;
+  runProgram(&prog);
+  running = false;
 }
+#endif
 
 void handle_example(char const * const cmd, char const * const * param, int numParams)
 {
@@ -857,21 +6033,124 @@ void handle_example(char const * const cmd, char const * const * param, int numP
 
 /**
  * @brief Format and output to stream, using call-back given.
+ * Output is limited to MAX_TOTAL_COMMAND_CHARS characters per call, and truncated beyond that.
  * 
  * @param fmt 
  * @param ... 
  */
-static void uP_printf(char * fmt, ...)
+static void uP_printf(const char * fmt, ...)
 {
   va_list args;
   char str[MAX_TOTAL_COMMAND_CHARS+1];
 
   va_start(args, fmt);
-  vsprintf(str, fmt, args);
+  vsnprintf(str, sizeof(str), fmt, args);
   va_end(args);
 
-  int len = strlen(str);
+  outStr(str, strlen(str));
+}
+
+/**
+ * @brief Output a string of known length, using call-back given.
+ * 
+ * @param str characters to output
+ * @param len number of characters
+ */
+static void outStr(const char * str, int len)
+{
   int i;
   for (i=0;i<len;i++)
     outChar(str[i]);
 }
+
+#if UP_FEATURE_DUMP
+/**
+ * @brief Built-in handler to dump memory in hex, at an address and length given in decimal, or hex as 0x...
+ * No check is made that the memory may be read.
+ * 
+ * @param cmd command string
+ * @param param list of pointers to parameter strings - use as param[0], param[1] ...
+ * @param numParams number of parameters parsed for this command
+ */
+static void handle_dump(char const * const cmd, char const * const * param, int numParams)
+{
+  (void)cmd;
+  char * addrEnd;
+  char * lenEnd;
+
+  if (!uP_confirmParameters(numParams, 2))
+    return;
+  unsigned long addr = strtoul(param[0], &addrEnd, 0);
+  unsigned long len = strtoul(param[1], &lenEnd, 0);
+  if ((*addrEnd != '\0') || (*lenEnd != '\0'))
+  {
+    uP_printf("*** Address and length must be numbers ***%s", g_s->outLineEnd);
+    g_status = UP_STATUS_PARAMS;
+    return;
+  }
+
+  uP_dump((const void *)(uintptr_t)addr, len, addr);
+}
+
+/**
+ * @brief Output a hex dump of memory, 16 bytes per line, with address, hex and ASCII columns, as:
+ *   00001000  48 65 6C 6C 6F 2C 20 77  6F 72 6C 64 21 0D 0A 00  |Hello, world!...|
+ * The address has as many hex digits as an unsigned long holds: 8 where it is 32 bits, 16 where it is 64.
+ * For use by handlers. Each line is built with table look-ups in a small buffer on the stack, and written out whole,
+ * so any length may be dumped in constant memory, without the cost (or buffer limit) of formatted print.
+ * 
+ * @param data memory to dump
+ * @param len number of bytes to dump
+ * @param addr address to show for the first byte, such as the offset into a file, or (unsigned long)data
+ */
+void uP_dump(const void * data, unsigned long len, unsigned long addr)
+{
+  static const char kHex[] = "0123456789ABCDEF";
+  const unsigned char * p = (const unsigned char *)data;
+  char line[sizeof(unsigned long)*2 + 2 + 16*3 + 1 + 2 + 16 + 1 + sizeof(g_s->outLineEnd)];  // address, hex, gap, ASCII, line-end
+  unsigned long offset;
+  int i;
+
+  for (offset=0;offset<len;offset+=16)
+  {
+    char * o = line;
+    unsigned long a = addr + offset;
+    int n = ((len - offset) < 16) ? (int)(len - offset) : 16;
+
+    // Address, all the hex digits of an unsigned long.
+    for (i=(int)sizeof(unsigned long)*8-4;i>=0;i-=4)
+      *o++ = kHex[(a >> i) & 0x0F];
+    *o++ = ' ';
+    *o++ = ' ';
+
+    // Hex bytes, with an extra space between the halves, and padding for a short last line.
+    for (i=0;i<16;i++)
+    {
+      if (i < n)
+      {
+        *o++ = kHex[p[i] >> 4];
+        *o++ = kHex[p[i] & 0x0F];
+      } else
+      {
+        *o++ = ' ';
+        *o++ = ' ';
+      }
+      *o++ = ' ';
+      if (i == 7)
+        *o++ = ' ';
+    }
+
+    // ASCII, with '.' for anything not printable.
+    *o++ = ' ';
+    *o++ = '|';
+    for (i=0;i<n;i++)
+      *o++ = ((p[i] >= ' ') && (p[i] <= '~')) ? p[i] : '.';
+    *o++ = '|';
+    for (i=0;g_s->outLineEnd[i] != '\0';i++)
+      *o++ = g_s->outLineEnd[i];
+
+    outStr(line, o - line);
+    p += 16;
+  }
+}
+#endif
@@ -1,6 +1,9 @@
 #ifndef UP_H
 #define UP_H
 
+#include <stddef.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -8,6 +11,7 @@ extern "C" {
 #define UP_VERSION 0.02   ///< this is a pre-release version: not for distribution beyond specific projects
 
 // Defines. Some or all of these may be adjusted down to save RAM, or up to accommodate larger strings or number of parameters.
+// Line, history, command, prompt and output sizes are those of the default session - others may be sized at run time, see uP_Init().
 // TODO: might be nice to comment on the impact on memory of expanding each of these.
 #define MAX_STR 16          ///< maximum command or parameter string expected, for sizing arrays.
 #define MAX_PARAMETERS 8    ///< maximum number of command and parameter strings expected - note this will multiply by MAX_STR when allocating string storage!
@@ -15,13 +19,373 @@ extern "C" {
 #define MAX_HISTORY 16      ///< depth of recall history
 #define MAX_COMMANDS 64     ///< maximum number of command handlers that may be registered
 #define MAX_SHELL_PROMPT 16 ///< maximum characters allowed for prompt string
+#define TERMINAL_WIDTH 80   ///< terminal columns assumed for listing commands on a second TAB, see uP_setTerminalWidth()
+#define MAX_HINT_WORDS 64   ///< maximum parameter values, over all commands' hints, indexed for TAB completion
+#define MAX_RESPONSE_CHARS 256  ///< maximum command output captured for a machine-mode response frame - longer output is truncated
+#define MAX_SCRIPT_DEPTH 4  ///< maximum nesting of scripts run from scripts, as by "source", to stop a script that runs itself
+
+// Lock around uP's state, for calls from more than one thread or interrupt context, as uP_Execute() from a remote procedure
+// call task while a console task calls uP_ProcessChar(). Define both, as to take and give a mutex, on the compiler command
+// line or before including uP.h. Handlers are called with the lock held, so a handler that calls back into uP needs a
+// recursive lock. The call-back given to uP_setIdleTimeout() is called with the lock given up, so needs no such lock.
+#ifndef UP_LOCK
+#define UP_LOCK()           ///< take lock around uP's state - nothing by default
+#define UP_UNLOCK()         ///< give lock around uP's state - nothing by default
+#endif
+
+// Feature profiles, trading features for code size and RAM. The profile sets the default for each UP_FEATURE_ define (and
+// for the optional subsystems below), any of which may still be set individually. See footprint.sh for the size of each.
+// STANDARD is the default, so a build without defines keeps the features it always had, and none of the static pools of
+// the optional subsystems (watches, dashboards, timers, broadcasts, pipes, compiled scripts) - ask for FULL, or for each
+// subsystem, to have them.
+#define UP_PROFILE_MINIMAL 1    ///< line editing and commands only
+#define UP_PROFILE_STANDARD 2   ///< adds history recall, function keys, TAB completion, help, hints, suggestions, paste, key bindings, hex dump and scripts
+#define UP_PROFILE_FULL 3       ///< adds machine mode, JSON mode, streaming handlers, sessions at run time, and the optional subsystems below
+#ifndef UP_PROFILE
+#define UP_PROFILE UP_PROFILE_STANDARD
+#endif
+#ifndef UP_FEATURE_HISTORY
+#define UP_FEATURE_HISTORY (UP_PROFILE >= UP_PROFILE_STANDARD)  ///< up/down arrow recall of previous lines - the history buffer is the biggest user of RAM
+#endif
+#ifndef UP_FEATURE_FKEYS
+#define UP_FEATURE_FKEYS (UP_PROFILE >= UP_PROFILE_STANDARD)    ///< recognize (and ignore) F1-F9 - without, their escape sequences may leave stray characters
+#endif
+#ifndef UP_FEATURE_TAB
+#define UP_FEATURE_TAB (UP_PROFILE >= UP_PROFILE_STANDARD)      ///< TAB completion of commands
+#endif
+#ifndef UP_FEATURE_HELP
+#define UP_FEATURE_HELP (UP_PROFILE >= UP_PROFILE_STANDARD)     ///< built-in "help" command, and help strings kept with each command
+#endif
+#ifndef UP_FEATURE_HINTS
+#define UP_FEATURE_HINTS (UP_PROFILE >= UP_PROFILE_STANDARD)    ///< parameter hints: TAB completion of values, and ghost placeholders
+#endif
+#ifndef UP_FEATURE_SUGGEST
+#define UP_FEATURE_SUGGEST (UP_PROFILE >= UP_PROFILE_STANDARD)  ///< suggest similar commands when a command is unknown
+#endif
+#ifndef UP_FEATURE_PASTE
+#define UP_FEATURE_PASTE (UP_PROFILE >= UP_PROFILE_STANDARD)    ///< bracketed paste, and paste detected from bursts of input - uP_ProcessCharAt()
+#endif
+#ifndef UP_FEATURE_KEYMAP
+#define UP_FEATURE_KEYMAP (UP_PROFILE >= UP_PROFILE_STANDARD)   ///< key bindings table, emacs and vi presets - without, keys are bound as UP_KEYMAP_DEFAULT
+#endif
+#ifndef UP_FEATURE_SCRIPTS
+#define UP_FEATURE_SCRIPTS (UP_PROFILE >= UP_PROFILE_STANDARD)  ///< uP_RunScript(), scripts of commands run from memory
+#endif
+#ifndef UP_FEATURE_DUMP
+#define UP_FEATURE_DUMP (UP_PROFILE >= UP_PROFILE_STANDARD)     ///< uP_dump(), hex dump for handlers, and the built-in "dump" command
+#endif
+#ifndef UP_FEATURE_MACHINE
+#define UP_FEATURE_MACHINE (UP_PROFILE >= UP_PROFILE_FULL)      ///< machine mode: framed requests and responses, with CRC
+#endif
+#ifndef UP_FEATURE_JSON
+#define UP_FEATURE_JSON (UP_PROFILE >= UP_PROFILE_FULL)         ///< JSON response mode, see uP_setResponseMode()
+#endif
+#ifndef UP_FEATURE_STREAM
+#define UP_FEATURE_STREAM (UP_PROFILE >= UP_PROFILE_FULL)       ///< streaming handlers, see uP_RegisterStreamHandler()
+#endif
+#ifndef UP_FEATURE_SESSIONS
+#define UP_FEATURE_SESSIONS (UP_PROFILE >= UP_PROFILE_FULL)     ///< sessions set up at run time by uP_Init() - without, only the default session
+#endif
+
+// Script files ("source" command and uP_RunScriptFile()) need a file system, so are only built by default for desktop builds.
+#if !defined(UP_SCRIPT_FILES) && (UP_PROFILE >= UP_PROFILE_FULL) && (defined(__linux__) || defined(_WIN32))
+#define UP_SCRIPT_FILES 1   ///< set to 1 to build support for running script files, 0 to leave out
+#endif
+
+// Compiled scripts, see uP_CompileScript(). Also sizes the program compiled and run by the built-in "run" command.
+// A parameter given as $name, where the script has no variable of that name, is the session's variable (see UP_VARIABLES).
+#ifndef UP_COMPILED_SCRIPTS
+#define UP_COMPILED_SCRIPTS (UP_PROFILE >= UP_PROFILE_FULL) ///< set to 1 to build support for compiled scripts, 0 to leave out
+#endif
+#define MAX_PROGRAM_OPS 32      ///< maximum statements in a compiled script
+#define MAX_PROGRAM_PARAMS 32   ///< maximum parameters, over all commands in a compiled script
+#define MAX_PROGRAM_TEXT 256    ///< maximum characters of parameter text, over all commands in a compiled script
+#define MAX_PROGRAM_VARS 8      ///< maximum variables in a compiled script
+#define MAX_PROGRAM_DEPTH 4     ///< maximum nesting of repeat and if blocks in a compiled script
+
+// Aliases and macros: commands defined at run time as a list of other commands, see the built-in "alias" command.
+#ifndef UP_ALIASES
+#define UP_ALIASES (UP_PROFILE >= UP_PROFILE_FULL)  ///< set to 1 to build support for aliases, 0 to leave out
+#endif
+#define MAX_ALIASES 16          ///< maximum aliases defined at once
+#define MAX_ALIAS_TOKENS 64     ///< maximum tokens, over all aliases' commands
+#define MAX_ALIAS_TEXT 256      ///< maximum characters of alias names and commands, over all aliases
+#define MAX_ALIAS_DEPTH 4       ///< maximum nesting of aliases that use others
+
+// Variables, set by the built-in "set" command and given as parameters by name, as $name.
+#ifndef UP_VARIABLES
+#define UP_VARIABLES (UP_PROFILE >= UP_PROFILE_FULL)    ///< set to 1 to build support for variables, 0 to leave out
+#endif
+#define MAX_VARIABLES 32        ///< maximum variables set at once, in each session
+#define MAX_VARIABLE_TEXT 512   ///< maximum characters of variable names and values, over all variables of a session
+
+// Pipes: command output passed through filters (grep, head, tail, count) or to streaming handlers, as "log | grep err | count".
+#ifndef UP_PIPES
+#define UP_PIPES (UP_PROFILE >= UP_PROFILE_FULL)    ///< set to 1 to build support for pipes, 0 to leave out
+#endif
+#define MAX_PIPE_CHARS 1024     ///< maximum command output passed through a pipe - more is lost
+#define MAX_PIPE_LINES 64       ///< maximum lines of command output passed through a pipe - more are lost
+
+// Watches: commands run periodically by the built-in "watch" command, on timers driven by uP_Poll().
+#ifndef UP_WATCH
+#define UP_WATCH (UP_PROFILE >= UP_PROFILE_FULL)    ///< set to 1 to build support for watches, 0 to leave out
+#endif
+#define MAX_WATCHES 16          ///< maximum watches running at once, over all sessions
+#define UP_TICK_MS 10           ///< resolution of timers, such as the interval of a watch, in milliseconds
+#define MAX_DASHBOARDS 2        ///< maximum watches drawn as dashboards (watch -d) at once, over all sessions
+#define MAX_DASHBOARD_CHARS 1024    ///< maximum output of a dashboard, kept to compare with the next - more is drawn in full
+
+// Idle timeouts: sessions ended after a time without input, timed by uP_Poll() as for watches, see uP_setIdleTimeout().
+#ifndef UP_IDLE_TIMEOUTS
+#define UP_IDLE_TIMEOUTS (UP_PROFILE >= UP_PROFILE_FULL)    ///< set to 1 to build support for idle timeouts, 0 to leave out
+#endif
+
+// Session pool: sessions opened and closed at run time, reusing the memory of those closed, see uP_InitSessionPool().
+#ifndef UP_SESSION_POOL
+#define UP_SESSION_POOL (UP_PROFILE >= UP_PROFILE_FULL)     ///< set to 1 to build support for a session pool, 0 to leave out
+#endif
+
+// Broadcasts: a line of output sent to every session, between lines typed, see uP_Broadcast().
+#ifndef UP_BROADCAST
+#define UP_BROADCAST (UP_PROFILE >= UP_PROFILE_FULL)    ///< set to 1 to build support for broadcasts, 0 to leave out
+#endif
+#define MAX_BROADCASTS 4        ///< maximum broadcasts waiting to be sent at once, each shared by every session
+#define MAX_BROADCAST_CHARS 256 ///< maximum characters of a broadcast, including null-terminator - more are lost
+#define MAX_BROADCAST_QUEUE 4   ///< maximum broadcasts waiting to be sent to one session - more are not sent to it
+
+#if (UP_IDLE_TIMEOUTS || UP_SESSION_POOL || UP_BROADCAST) && !UP_FEATURE_SESSIONS
+#error "idle timeouts, the session pool and broadcasts need UP_FEATURE_SESSIONS"
+#endif
+
+// Cache of recently parsed commands, so that commands repeated (or recalled from history) skip splitting and look-up.
+// Each entry costs about MAX_TOTAL_COMMAND_CHARS + 4 * MAX_PARAMETERS bytes of RAM.
+#ifndef UP_PARSE_CACHE
+#define UP_PARSE_CACHE ((UP_PROFILE >= UP_PROFILE_FULL) ? 4 : 0)   ///< number of commands cached, 0 to leave out
+#endif
+
+#define UP_FRAME_SOF 0x02   ///< start of each machine-mode frame (STX) - also switches to machine mode when received at the start of a line
+
+/**
+ * @brief Status of the latest command processed, as reported in machine-mode response frames.
+ * 
+ */
+enum
+{
+  UP_STATUS_OK = 0,     ///< command handled
+  UP_STATUS_UNKNOWN,    ///< command not recognized
+  UP_STATUS_PARAMS,     ///< wrong number or form of parameters, see uP_confirmParameters()
+  UP_STATUS_FAILED,     ///< handler reported failure, see uP_setStatus()
+  UP_STATUS_OVERFLOW,   ///< command or its output too long for buffers, and truncated
+  UP_STATUS_BAD_FRAME,  ///< machine-mode request frame failed its CRC check
+};
+
+/**
+ * @brief Response modes for interactive input, see uP_setResponseMode().
+ * 
+ */
+enum
+{
+  UP_RESPONSE_TEXT = 0,   ///< for people: echo, prompt, and command output as is
+  UP_RESPONSE_JSON,       ///< for automation: no echo or prompt, and one JSON object per command line, with id, status and output
+};
+
+/**
+ * @brief Keys, as given to uP_bindKey(). Characters are their own ASCII code (ctrl-A is 0x01, see UP_KEY_CTRL(), and
+ * escape alone is 0x1B), and keys sending escape sequences are numbered from 0x100, above any byte received.
+ * 
+ */
+enum
+{
+  UP_KEY_UP = 0x100,
+  UP_KEY_DOWN,
+  UP_KEY_RIGHT,
+  UP_KEY_LEFT,
+  UP_KEY_DEL,
+  UP_KEY_HOME,
+  UP_KEY_END,
+  UP_KEY_CTRL_RIGHT,
+  UP_KEY_CTRL_LEFT,
+  UP_KEY_F1,
+  UP_KEY_F2,
+  UP_KEY_F3,
+  UP_KEY_F4,
+  UP_KEY_F5,
+  UP_KEY_F6,
+  UP_KEY_F7,
+  UP_KEY_F8,
+  UP_KEY_F9,
+};
+#define UP_KEY_CTRL(c) ((c) & 0x1F)   ///< key for ctrl and a letter, as UP_KEY_CTRL('A')
+#define UP_KEY_ESC 0x1B               ///< escape, alone rather than starting a key's escape sequence
+
+/**
+ * @brief Line editing actions, bound to keys by uP_bindKey().
+ * 
+ */
+enum
+{
+  UP_ACT_NONE = 0,        ///< ignore key
+  UP_ACT_INSERT,          ///< insert the key's character at the cursor
+  UP_ACT_ENTER,           ///< end line - c/r-l/f and l/f-c/r pairs end just one line
+  UP_ACT_BACKSPACE,       ///< delete character before cursor
+  UP_ACT_DELETE,          ///< delete character at cursor
+  UP_ACT_LEFT,            ///< cursor left
+  UP_ACT_RIGHT,           ///< cursor right
+  UP_ACT_HOME,            ///< cursor to start of line
+  UP_ACT_END,             ///< cursor to end of line
+  UP_ACT_WORD_LEFT,       ///< cursor to start of word
+  UP_ACT_WORD_RIGHT,      ///< cursor past end of word
+  UP_ACT_COMPLETE,        ///< complete the word at the end of the line - again, to list candidate commands
+  UP_ACT_HISTORY_PREV,    ///< recall previous line of history
+  UP_ACT_HISTORY_NEXT,    ///< recall next line of history
+  UP_ACT_KILL_END,        ///< delete from cursor to end of line
+  UP_ACT_KILL_START,      ///< delete from start of line to cursor
+  UP_ACT_KILL_WORD,       ///< delete word before cursor
+  UP_ACT_VI_COMMAND,      ///< switch to vi command mode, until i, a, I, A or line end
+};
+
+/**
+ * @brief Key binding presets, see uP_setKeymap().
+ * 
+ */
+enum
+{
+  UP_KEYMAP_DEFAULT = 0,  ///< arrows, home, end, delete, backspace and TAB
+  UP_KEYMAP_EMACS,        ///< default, plus ctrl-A/E/B/F/D/K/U/W/P/N
+  UP_KEYMAP_VI,           ///< default, plus ctrl-U/W, and escape for vi command mode: h l 0 $ w b x D k j, and i a I A to insert
+};
+
+#if UP_FEATURE_SESSIONS
+/**
+ * @brief Sizes of a session set up by uP_Init(), in place of the MAX_ defines. Zero takes the default (the MAX_ define).
+ * 
+ */
+typedef struct
+{
+  int maxLine;        ///< longest command line, in characters - 0 for MAX_TOTAL_COMMAND_CHARS (uP_Execute() is held to that regardless)
+  int maxHistory;     ///< depth of recall history - 0 for MAX_HISTORY, or -1 for none (always none without UP_FEATURE_HISTORY)
+  int maxCommands;    ///< commands the session registers for itself, built-ins included - 0 to share the default session's commands
+  int maxPrompt;      ///< maximum characters of prompt - 0 for MAX_SHELL_PROMPT
+  int maxOutput;      ///< output buffered for return when no call-back given - 0 for MAX_STR
+  int maxResponse;    ///< command output captured for a machine-mode or JSON response - 0 for MAX_RESPONSE_CHARS
+  int maxVariableText;    ///< characters of variable names and values - 0 for MAX_VARIABLE_TEXT, or -1 for no variables (always none without UP_VARIABLES)
+} uP_Config;
+#endif
+
+typedef struct uP_Session uP_Session;   ///< a session: one terminal's line, history, output and modes, see uP_Init()
+
+#if UP_COMPILED_SCRIPTS
+/**
+ * @brief One statement of a compiled script. For use by uP.c only.
+ * 
+ */
+typedef struct
+{
+  unsigned char op;         ///< statement type
+  unsigned char numParams;  ///< command: number of parameters
+  unsigned char numVarParams; ///< command: number of parameters that are variables, substituted when run
+  signed char bSign;        ///< let: 1 to add second operand, -1 to subtract, 0 if none
+  short first;              ///< command: index of first parameter in param[] - let: variable to set
+  short next;               ///< repeat, if, else: statement to continue with when skipping the block - end: matching repeat
+  short aVar;               ///< repeat, let: variable holding first operand, or -1 to use aValue
+  short bVar;               ///< let: variable holding second operand, or -1 to use bValue
+  long aValue;              ///< repeat, let: first operand, if constant
+  long bValue;              ///< let: second operand, if constant
+  const char * cmd;         ///< command: command string, as registered
+  void (*handler)(char const * const cmd, char const * const * param, int numParams);  ///< command: resolved handler
+} uP_Op;
+
+/**
+ * @brief A compiled script, see uP_CompileScript(). Large, so best declared static.
+ * 
+ */
+typedef struct
+{
+  uP_Op op[MAX_PROGRAM_OPS];                  ///< statements
+  const char * param[MAX_PROGRAM_PARAMS];     ///< pre-split parameters of all commands, pointing into text[]
+  signed char paramVar[MAX_PROGRAM_PARAMS];   ///< variable substituted for each parameter when run, -1 if none, or -2 for a session variable
+  char text[MAX_PROGRAM_TEXT];                ///< parameter strings
+  char varName[MAX_PROGRAM_VARS][MAX_STR+1];  ///< variable names
+  long var[MAX_PROGRAM_VARS];                 ///< variable values, while running
+  int numOps;
+  int numParams;
+  int textLen;
+  int numVars;
+} uP_Program;
+#endif
 
 // Prototypes.
+#if UP_FEATURE_SESSIONS
+size_t uP_RequiredMemory(const uP_Config * config);
+uP_Session * uP_Init(void * mem, size_t size, const uP_Config * config);
+uP_Session * uP_SelectSession(uP_Session * session);
+void uP_EndSession(uP_Session * session);
+#endif
+#if UP_SESSION_POOL
+int uP_InitSessionPool(void * mem, size_t size, const uP_Config * config);
+uP_Session * uP_OpenSession(void);
+void uP_CloseSession(uP_Session * session);
+void uP_getSessionPoolStats(unsigned long * opens, unsigned long * warm, unsigned long * refused, int * inUse);
+#endif
 bool uP_RegisterHandler(const char * cmd, void (*handler)(char const * const cmd, char const * const * param, int numParams), const char * help, char const * const * hints);
+#if UP_FEATURE_STREAM
+bool uP_RegisterStreamHandler(const char * cmd, void (*stream)(char const * const cmd, char const * data, int len, bool final), const char * help);
+#endif
 char * uP_ProcessChar(const char c, int (*cb_out)(int c));
+char * uP_ProcessChars(const char * str, int len, int (*cb_out)(int c));
+char * uP_Poll(unsigned long ms, int (*cb_out)(int c));
+#if UP_FEATURE_PASTE
+char * uP_ProcessCharAt(const char c, unsigned long ms, int (*cb_out)(int c));
+void uP_setBurstDetect(unsigned int gapMs, int minBytes);
+void uP_setBracketedPaste(bool enable);
+#endif
 void uP_setOutLineEnd(const char * str);
 void uP_setPrompt(const char * str);
+void uP_setTerminalWidth(int cols);
+#if UP_FEATURE_KEYMAP
+void uP_setKeymap(int preset);
+bool uP_bindKey(int key, int action);
+#endif
 bool uP_confirmParameters(int numGivenParams, int numExpectedParams);
+void uP_setStatus(int status);
+#if UP_FEATURE_DUMP
+void uP_dump(const void * data, unsigned long len, unsigned long addr);
+#endif
+#if UP_FEATURE_MACHINE
+void uP_setMachineMode(bool enable);
+#endif
+#if UP_FEATURE_JSON
+void uP_setResponseMode(int mode);
+#endif
+#if UP_FEATURE_SCRIPTS
+int uP_RunScript(const char * script, int len, bool stopOnError, int (*cb_out)(int c));
+#endif
+// uP_Execute() and uP_ExecuteTo() take lines of up to MAX_TOTAL_COMMAND_CHARS, even for a session with a longer maxLine -
+// longer lines are refused with UP_STATUS_OVERFLOW.
+int uP_Execute(const char * line, char * out, int size, int * outLen);
+int uP_ExecuteTo(const char * line, int (*cb_out)(int c));
+#if UP_PARSE_CACHE
+void uP_getParseCacheStats(unsigned long * hits, unsigned long * misses);
+#endif
+#if UP_COMPILED_SCRIPTS
+int uP_CompileScript(const char * script, int len, uP_Program * prog, int (*cb_out)(int c));
+int uP_RunProgram(uP_Program * prog, int (*cb_out)(int c));
+#endif
+#if UP_ALIASES
+void uP_getAliasStats(unsigned long * expansions, int * maxDepth, unsigned long * tooDeep);
+#endif
+#if UP_WATCH
+void uP_getDashboardStats(unsigned long * refreshes, unsigned long * sent, unsigned long * saved);
+#endif
+#if UP_IDLE_TIMEOUTS
+void uP_setIdleTimeout(unsigned long ms, unsigned long warnMs, void (*expired)(uP_Session * session));
+#endif
+#if UP_BROADCAST
+int uP_Broadcast(const char * fmt, ...);
+#endif
+#if UP_SCRIPT_FILES
+int uP_RunScriptFile(const char * path, bool stopOnError, int (*cb_out)(int c));
+#endif
 
 #ifdef __cplusplus
 } // extern "C"